@@ -0,0 +1,109 @@
+#!/bin/sh
+# Times listing and extraction of synthetic archives with mytar and, when they are
+# installed, GNU tar and bsdtar.
+#
+# usage: bench/bench.sh [mytar binary] [scale]
+#
+# RUNS sets the number of runs per case (best one is reported), BENCH_DIR the directory
+# holding generated archives and extracted files. Archives are read from page cache
+# after the first run, so the numbers show CPU and syscall cost rather than disk speed.
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+mytar=$(cd "$(dirname "${1:-./mytar}")" && pwd)/$(basename "${1:-./mytar}")
+scale=${2:-1}
+runs=${RUNS:-3}
+dir=${BENCH_DIR:-${TMPDIR:-/tmp}/mytar-bench}
+
+if [ ! -x "$mytar" ]
+then
+    echo "mytar binary not found: $mytar" >&2
+    exit 2
+fi
+
+mkdir -p "$dir"
+cc -O2 -o "$dir/genarchive" "$here/genarchive.c"
+
+tools="mytar"
+command -v tar > /dev/null && tools="$tools tar"
+command -v bsdtar > /dev/null && tools="$tools bsdtar"
+
+now()
+{
+    date +%s%N
+}
+
+# runs the command $runs times in an empty directory, prints the best time in nanoseconds
+best_time()
+{
+    best=
+    i=0
+
+    while [ $i -lt "$runs" ]
+    do
+        rm -rf "$dir/out"
+        mkdir "$dir/out"
+        start=$(now)
+        (cd "$dir/out" && "$@" > /dev/null)
+        elapsed=$(($(now) - start))
+
+        if [ -z "$best" ] || [ $elapsed -lt $best ]
+        then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+
+    rm -rf "$dir/out"
+    echo $best
+}
+
+report()
+{
+    awk -v profile="$1" -v operation="$2" -v tool="$3" -v ns="$4" -v bytes="$5" \
+        'BEGIN { printf "%-6s %-8s %-16s %8.3f s %9.1f MB/s\n", profile, operation, tool, ns / 1e9, bytes / (ns / 1e9) / 1e6 }'
+}
+
+tool_command()
+{
+    case $1 in
+        mytar)      echo "$mytar" ;;
+        mytar-j8)   echo "$mytar -j 8" ;;
+        mytar-uring) echo "$mytar --io-uring" ;;
+        *)          echo "$1" ;;
+    esac
+}
+
+for profile in tiny huge mixed deep
+do
+    archive="$dir/$profile-$scale.tar"
+
+    if [ ! -f "$archive" ]
+    then
+        "$dir/genarchive" $profile "$scale" > "$archive"
+    fi
+
+    bytes=$(wc -c < "$archive")
+
+    for tool in $tools
+    do
+        report $profile list $tool "$(best_time $(tool_command $tool) -t -f "$archive")" "$bytes"
+    done
+
+    for tool in $tools mytar-j8 mytar-uring
+    do
+        report $profile extract $tool "$(best_time $(tool_command $tool) -x -f "$archive")" "$bytes"
+    done
+done
+
+# looking up many file arguments stresses matching of names rather than reading,
+# directories are left out as tar would also match everything below them
+archive="$dir/tiny-$scale.tar"
+"$mytar" -t -f "$archive" | awk '!/\/$/ && ++count % 50 == 0' > "$dir/names"
+bytes=$(wc -c < "$archive")
+
+for tool in $tools
+do
+    report tiny lookup $tool "$(best_time xargs -a "$dir/names" $(tool_command $tool) -t -f "$archive")" "$bytes"
+done
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <err.h>
+
+#define BLOCK_SIZE  512
+#define MAGIC       "ustar  "
+#define DATA_SIZE   (1L << 20)              // member contents are slices of this much random data
+#define MTIME       1700000000L
+#define SMALL_SIZE  (16L << 10)
+
+// GNU tar header, as written by mytar -c
+struct Header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag[1];
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+char data[DATA_SIZE];
+uint64_t state = 88172645463325252ULL;
+long archive_size = 0;
+
+// xorshift, so that generated archives are the same on every run
+uint64_t next_random(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+void write_bytes(const void *bytes, long size)
+{
+    if (fwrite(bytes, 1, size, stdout) != (size_t)size)
+    {
+        errx(2, "Error writing archive");
+    }
+    archive_size += size;
+}
+
+void write_padding(long size)
+{
+    static char zeros[BLOCK_SIZE];
+    long padding = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+
+    write_bytes(zeros, padding);
+}
+
+void write_header(const char *name, char type, long size, const char *mode)
+{
+    struct Header header;
+    unsigned long sum = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.name, name, strlen(name) < sizeof(header.name) ? strlen(name) : sizeof(header.name) - 1);
+    snprintf(header.mode, sizeof(header.mode), "%s", mode);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 1000);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 1000);
+    snprintf(header.size, sizeof(header.size), "%011lo", size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011lo", MTIME);
+    header.typeflag[0] = type;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    snprintf(header.uname, sizeof(header.uname), "bench");
+    snprintf(header.gname, sizeof(header.gname), "bench");
+    memset(header.chksum, ' ', sizeof(header.chksum));
+
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        sum += ((unsigned char*)&header)[i];
+    }
+    snprintf(header.chksum, sizeof(header.chksum), "%06lo", sum);
+    header.chksum[7] = ' ';
+
+    write_bytes(&header, sizeof(header));
+}
+
+// names that don't fit the header are preceded by a GNU long name member
+void write_member(const char *name, char type, long size)
+{
+    long length = strlen(name);
+
+    if (length >= 100)
+    {
+        write_header("././@LongLink", 'L', length + 1, "0000644");
+        write_bytes(name, length + 1);
+        write_padding(length + 1);
+    }
+
+    write_header(name, type, size, type == '5' ? "0000755" : "0000644");
+}
+
+void write_file(const char *name, long size)
+{
+    write_member(name, '0', size);
+
+    for (long left = size; left > 0; )
+    {
+        long start = next_random() % DATA_SIZE;
+        long count = DATA_SIZE - start < left ? DATA_SIZE - start : left;
+
+        write_bytes(data + start, count);
+        left -= count;
+    }
+
+    write_padding(size);
+}
+
+void write_directory(const char *name)
+{
+    write_member(name, '5', 0);
+}
+
+// files spread over directories, sizes are random below max_size,
+// when skewed only one file in 200 may be that large and the rest is below SMALL_SIZE
+void write_tree(const char *root, long files, long directories, long max_size, bool skewed)
+{
+    char name[4096];
+
+    snprintf(name, sizeof(name), "%s/", root);
+    write_directory(name);
+
+    for (long d = 0; d < directories; d++)
+    {
+        snprintf(name, sizeof(name), "%s/dir%04ld/", root, d);
+        write_directory(name);
+
+        for (long f = d; f < files; f += directories)
+        {
+            long limit = skewed && next_random() % 200 != 0 ? SMALL_SIZE : max_size;
+            long size = (long)(next_random() % limit);
+
+            snprintf(name, sizeof(name), "%s/dir%04ld/file%07ld", root, d, f);
+            write_file(name, size);
+        }
+    }
+}
+
+// files at the bottom of a chain of nested directories with long names
+void write_deep(const char *root, long files, int depth)
+{
+    char name[4096];
+    long length = snprintf(name, sizeof(name), "%s/", root);
+
+    write_directory(name);
+
+    for (int i = 0; i < depth; i++)
+    {
+        length += snprintf(name + length, sizeof(name) - length, "level%02d-with-a-rather-long-directory-name/", i);
+        write_directory(name);
+    }
+
+    for (long f = 0; f < files; f++)
+    {
+        snprintf(name + length, sizeof(name) - length, "file%07ld", f);
+        write_file(name, next_random() % 4096);
+        name[length] = '\0';
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        errx(2, "usage: genarchive tiny|huge|mixed|deep [scale]");
+    }
+
+    // scale multiplies number or size of files, 1 gives archives of tens to hundreds of MiB
+    long scale = argc > 2 ? atol(argv[2]) : 1;
+
+    if (scale < 1)
+    {
+        errx(2, "Invalid scale");
+    }
+
+    for (long i = 0; i < DATA_SIZE; i += sizeof(uint64_t))
+    {
+        uint64_t value = next_random();
+
+        memcpy(data + i, &value, sizeof(value));
+    }
+
+    static char output_buffer[1 << 20];
+
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+    if (strcmp(argv[1], "tiny") == 0)
+    {
+        write_tree("tiny", 50000 * scale, 100, 1024, false);
+    }
+    else if (strcmp(argv[1], "huge") == 0)
+    {
+        write_tree("huge", 4, 1, (128L << 20) * scale, false);
+    }
+    else if (strcmp(argv[1], "mixed") == 0)
+    {
+        write_tree("mixed", 5000 * scale, 50, 8L << 20, true);
+    }
+    else if (strcmp(argv[1], "deep") == 0)
+    {
+        write_deep("deep", 5000 * scale, 40);
+    }
+    else
+    {
+        errx(2, "Unknown profile: %s", argv[1]);
+    }
+
+    // end of archive, padded to a record of 20 blocks like mytar -c does
+    long end = 2 * BLOCK_SIZE + (20 * BLOCK_SIZE - (archive_size + 2 * BLOCK_SIZE) % (20 * BLOCK_SIZE)) % (20 * BLOCK_SIZE);
+
+    static char zeros[BLOCK_SIZE];
+
+    for (long i = 0; i < end; i += BLOCK_SIZE)
+    {
+        write_bytes(zeros, BLOCK_SIZE);
+    }
+
+    return 0;
+}
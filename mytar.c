@@ -1,12 +1,113 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <err.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <grp.h>
+#include <glob.h>
+#include <time.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+
+#include "mytar.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#undef BLOCK_SIZE                           // linux/fs.h included by linux/io_uring.h has its own
 #define BLOCK_SIZE  512
 #define MAGIC       "ustar  "
+#define POSIX_MAGIC "ustar"                 // ustar and pax archives, version "00" follows
 #define REG_FILE    "0"
+#define OLD_FILE    ""                      // regular file in pre-POSIX archives
+#define HARD_LINK   "1"
+#define SYMLINK     "2"
+#define DIRECTORY   "5"
+#define CONTIGUOUS  "7"                     // extracted as a regular file
+#define SPARSE_FILE "S"                     // old GNU sparse member
+#define LONG_NAME   "L"                     // GNU long name of the next member
+#define LONG_LINK   "K"                     // GNU long link target of the next member
+#define LONG_LINK_NAME "././@LongLink"      // name of the records carrying them
+#define PAX_HEADER  "x"                     // pax records of the next member
+#define PAX_GLOBAL  "g"                     // pax records of all following members
+
+#define DEFAULT_BLOCKING_FACTOR 2048        // records of 1 MiB
+#define MAX_BLOCKING_FACTOR     32768       // records of 16 MiB
+#define BUFFER_ALIGNMENT        4096
+
+#define VOLUME_PREFETCH         (8L << 20)  // beginning of the next volume read while the current one is parsed
+
+#define DECOMPRESS_CHUNKS       4           // decompressed records buffered ahead of the reader
+#define MAGIC_LENGTH            4           // bytes needed to recognize a compressed archive
+
+#define SKIPPABLE_MAGIC         0x184d2a5e  // zstd skippable frame holding the seek table
+#define SEEKABLE_MAGIC          0x8f92eab1  // last bytes of seekable zstd archive
+#define SEEK_FOOTER_SIZE        9
+#define SEEK_CHECKSUM_FLAG      0x80
+
+#define MAX_JOBS                256
+#define MAX_RATE                1000000     // MB/s of --rate
+#define MAX_IOPS                10000000
+#define MAX_OPEN_FILES          1000000
+#define QUEUE_LENGTH            64          // pending work items per writer thread
+
+#define CREATE_QUEUE_LENGTH     64          // files between traversal and the archive writer
+#define PREFETCH_LIMIT          (1L << 20)  // larger files are streamed by the writer instead
+#define END_BLOCKS              2           // zero blocks marking end of archive
+#define MIN_RECORD_SIZE         (20 * BLOCK_SIZE)   // archive is padded to a multiple of this
+
+#define URING_DEPTH             64          // members being created through io_uring at once
+#define URING_MAX_SIZE          (64L << 10) // larger members are written by extract_file
+
+#define PREALLOCATE_MIN         (1L << 20)  // smaller files are not worth the extra syscall
+#define DIRECTORY_CACHE_SIZE    64          // parent directories kept open during extraction
+#define COMPARE_CHUNK           (256L << 10)    // files on disk are compared with members in pieces of this size
+#define HEADER_REGIONS          4           // sparse map entries in the GNU header
+#define EXTENSION_REGIONS       21          // sparse map entries in one extension block
+
+#define OUTPUT_BUFFER_SIZE      (1L << 20)  // listing written to a pipe or file is flushed in pieces of this size
+
+#define SCAN_CHUNK              (16L << 20) // part of the archive searched for headers by one thread at a time
+#define SCAN_MAX_SPAN           (1L << 20)  // scanning stops when members are larger than this on average
+
+#define MATCH_STATES_LIMIT      (1L << 18)  // states of the matching automaton are forgotten beyond this
+#define MEMORY_SHARE            4           // prefetched volumes and matching tables may each take 1/4 of --max-memory
+
+#define INDEX_SUFFIX            ".idx"
+
+#define READER_RECORDS          (DECOMPRESS_CHUNKS + 2) // buffers of the record size a compressed archive is read with
+#define THROTTLE_CHUNK          (256L << 10)    // largest transfer at once under --rate, so that it is paced evenly
+#define INDEX_MAGIC             "MYTARIX2"
+
+#define XXH_PRIME1              0x9e3779b185ebca87ULL   // constants of XXH64
+#define XXH_PRIME2              0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3              0x165667b19e3779f9ULL
+#define XXH_PRIME4              0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5              0x27d4eb2f165667c5ULL
+#define XXH_STRIPE              32
+#define EXPORT                  __attribute__((visibility("default")))   // library interface, built with -fvisibility=hidden
 
 // POSIX tar header
 struct Header
@@ -29,254 +130,6547 @@ struct Header
     char prefix[155];
 };
 
-// only listing and extracting files is now supported
+// old GNU header of a sparse member, fields after the POSIX ones replace prefix
+struct SparseHeader
+{
+    char posix[345];
+    char atime[12];
+    char ctime[12];
+    char offset[12];
+    char longnames[4];
+    char unused[1];
+    char sparse[HEADER_REGIONS][24];        // offset[12] and numbytes[12] of each data region
+    char isextended[1];
+    char realsize[12];
+    char pad[17];
+};
+
+// block continuing the sparse map when isextended is set in the previous one
+struct SparseExtension
+{
+    char sparse[EXTENSION_REGIONS][24];
+    char isextended[1];
+    char pad[7];
+};
+
+// data region of a sparse member, everything between regions is a hole
+struct Region
+{
+    long offset;
+    long size;
+};
+
+// sparse map of the current member, the array is reused for all members of the archive
+struct SparseMap
+{
+    struct Region *regions;
+    long count;
+    long capacity;
+    long real_size;                 // size of the extracted file
+};
+
+// attributes given by extended headers to the member that follows them,
+// names are limited to PATH_MAX, so they are kept without allocations
+struct Extended
+{
+    char name[PATH_MAX];
+    char link[PATH_MAX];
+    bool has_name;
+    bool has_link;
+    long size;                      // size from pax records, -1 if there was none
+    bool has_mtime;
+    long mtime;                     // seconds and nanoseconds from pax records
+    long mtime_nsec;
+    long uid;                       // from pax records, -1 if there was none
+    long gid;
+    long offset;                    // archive offset of the first extended header, -1 if there was none
+    char *data;                     // contents of extended headers read from a stream,
+    long capacity;                  // reused for all of them
+};
+
+// attributes of a member restored on the extracted file
+struct Metadata
+{
+    mode_t mode;                    // permissions, with umask applied unless run by root
+    uid_t uid;
+    gid_t gid;
+    bool owner;                     // ownership is restored, only root may do it
+    long mtime;
+    long mtime_nsec;                // nonzero only when pax records give a fraction of a second
+};
+
+// directory whose attributes are restored once all members are extracted,
+// so that files created in it later don't change its mtime
+struct DeferredDirectory
+{
+    char *name;                     // relative to the extraction root
+    struct Metadata metadata;
+};
+
+// open directory that extracted members are created in, the cache holds one reference
+// and every file queued for a writer thread or io_uring holds another until it is opened
+struct Directory
+{
+    int fd;
+    int references;
+    long used;                      // cache clock at the last lookup, least recently used is closed first
+    char path[];                    // relative to the extraction root
+};
+
+// directories are opened once for all members in them, so the kernel doesn't
+// resolve the whole path again for every file
+struct DirectoryCache
+{
+    struct Directory *root;         // -C directory or the current one, never evicted
+    bool creating;                  // missing directories are made, otherwise they are not found
+    struct Directory *entries[DIRECTORY_CACHE_SIZE];
+    int count;
+    int last;                       // entry found by the previous lookup
+    long clock;
+    struct DeferredDirectory *deferred;
+    long deferred_count;
+    long deferred_capacity;
+};
+
+enum compression
+{
+    NONE, GZIP, ZSTD
+};
+
+// error in reading the archive caught by a library call or the decompressor thread,
+// which return it instead of exiting the process
+struct Trap
+{
+    jmp_buf jump;
+    char message[256];
+    char *conclusion;               // second line tar reports for unrecoverable errors, NULL if none
+};
+
+// archive split into parts, which are read one after another as a single stream,
+// a thread opens the next volume and reads its beginning while the current one is parsed
+struct Volumes
+{
+    char **names;
+    int count;
+    int current;                    // index of the volume being read
+    int fd;
+    char *data;                     // prefetched beginning of the current volume
+    long prefetch;                  // size of data and next_data
+    long length;
+    long position;                  // next unread byte of data
+    pthread_t thread;
+    bool prefetching;               // thread is working on the next volume
+    int next_fd;
+    char *next_data;
+    long next_length;
+};
+
+// independently decompressible frame of a seekable zstd archive
+struct Frame
+{
+    long compressed;                // offset of the frame in the archive file
+    long offset;                    // offset of its first decompressed byte in the tar stream
+};
+
+// thread decompressing the archive ahead of the reader
+// chunks [consumed, produced) of the ring hold decompressed data, the reader copies
+// out of the oldest one while the thread fills the others
+struct Decompressor
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // signalled when a chunk is produced or consumed
+    int fd;
+    struct Volumes *volumes;        // NULL unless the archive is split
+    enum compression compression;
+    char *chunks[DECOMPRESS_CHUNKS];
+    long lengths[DECOMPRESS_CHUNKS];
+    long chunk_size;
+    long produced;
+    long consumed;
+    long position;                  // read position in the oldest chunk (reader only)
+    bool finished;                  // no chunks will be produced anymore
+    bool stopped;                   // reader doesn't want any more data
+    bool ended;                     // compressed stream is over
+    bool failed;                    // thread stopped on an error, which is raised to the reader
+    struct Trap trap;               // at the end of the chunks produced before it
+    char *input;                    // compressed input, starts with the magic already read
+    long input_size;
+    long input_length;
+    z_stream gzip;
+    ZSTD_DCtx *zstd;
+    ZSTD_inBuffer zstd_input;
+    size_t zstd_pending;            // nonzero while a zstd frame is incomplete
+    struct Frame *frames;           // seek table, frames_count + 1 entries ending with the end
+    long frames_count;              // of the last frame, 0 unless archive is seekable zstd
+};
+
+// source of archive blocks
+// regular files are mapped into memory and headers are parsed in place,
+// other inputs (pipes, tapes) are read in whole records into an aligned buffer
+// that hands out 512-byte blocks, compressed archives are decompressed into it
+struct Reader
+{
+    int fd;
+    struct Volumes *volumes;        // NULL unless the archive is split
+    struct Decompressor *decompressor;  // NULL for uncompressed archive
+    bool mapped;                    // true if archive is accessed through the mapping
+    char *map;                      // start of the mapping (NULL for an empty archive)
+    long size;                      // archive size in bytes
+    long mtime;                     // modification time of a regular-file archive
+    long offset;                    // archive offset of the next unread byte
+    char *buffer;                   // record buffer (non-mapped archive only)
+    long record_size;               // size of one read request, blocking factor * BLOCK_SIZE
+    int null_fd;                    // /dev/null, where skipped data of a pipe is spliced
+    long buffer_start;              // first unread byte in buffer
+    long buffer_end;                // end of valid data in buffer
+};
+
+// archive opened through the library interface, buffers of the current member
+// are reused for the next one, so iterating over entries allocates nothing
+struct mytar
+{
+    struct Reader reader;
+    struct Trap trap;               // error that made a call fail, no other call is allowed after it
+    bool failed;
+    bool first_empty;               // first zero block encountered
+    bool ended;                     // end of archive was reached
+    struct Header header;           // current member, copied out of the record buffer
+    struct Extended extended;
+    struct SparseMap sparse_map;
+    char name_buffer[PATH_MAX];
+    char link_buffer[PATH_MAX];
+    long data_size;                 // data of the current member stored in the archive
+    long data_left;                 // part of it not read yet
+};
+
+// what -d prints about a member compared with more than one job, it is collected while the member
+// is compared and printed once it is done and all members before it were printed
+struct Output
+{
+    FILE *stream;
+    char *text;
+    size_t length;
+    bool done;
+};
+
+// member to be written by a writer thread
+struct Job
+{
+    char name[PATH_MAX];
+    struct Directory *parent;       // file is created there under name + leaf
+    long leaf;
+    struct Metadata metadata;
+    long offset;                    // archive offset of member data
+    long size;                      // size of member data
+    struct Output *output;          // NULL unless the member is compared
+};
+
+// writer thread with its own bounded queue of jobs
+struct Worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // signalled when a job is added or removed, or on shutdown
+    struct Reader *reader;
+    struct Pool *pool;
+    struct Job jobs[QUEUE_LENGTH];
+    int first;                      // index of the oldest pending job
+    int count;                      // number of pending jobs
+    bool done;                      // no more jobs will be submitted
+    bool compare;                   // files on disk are compared with members instead of written
+    char *buffer;                   // file contents being compared
+    long differences;               // files that differ from their members
+};
+
+// writer threads fed by the header scanner, members with the same name always go
+// to the same worker so that later entries still overwrite earlier ones
+struct Pool
+{
+    struct Worker *workers;
+    int count;
+    long differences;               // summed over workers once they are finished
+    pthread_mutex_t lock;
+    pthread_cond_t finished;        // signalled when an output is done
+    struct Output *outputs;         // ring of members being compared, in archive order
+    long outputs_capacity;
+    long first_output;
+    long outputs_count;
+};
+
+// operations creating one member, user data of each is slot index * URING_OPS + operation
+enum uring_op
+{
+    URING_OPEN, URING_WRITE, URING_CLOSE, URING_OPS
+};
+
+// member being created by a chain of linked io_uring operations
+struct UringSlot
+{
+    char name[PATH_MAX];            // has to stay valid until openat completes
+    struct Directory *parent;       // openat is relative to it, released when the file is closed
+    long leaf;                      // offset of the last component in name
+    struct Metadata metadata;       // restored through the parent once the file is closed
+    char *data;                     // what is written, in the mapped archive
+    long size;                      // expected result of write
+    int pending;                    // operations not completed yet, 0 if slot is free
+    bool replace;                   // openat found a symbolic link, the file is written serially instead
+};
+
+// io_uring used to create many small files without blocking on each syscall,
+// every slot owns one registered file, which its openat, write and close operate on
+struct Uring
+{
+    int fd;
+    char *sq_ring;
+    char *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;                // prepared operations not submitted yet
+    int busy;                       // number of slots in use
+    int depth;                      // slots that may be used, fewer than URING_DEPTH under --max-open
+    long bytes;                     // data of members in the slots, bounded by --max-memory
+    struct UringSlot slots[URING_DEPTH];
+};
+
+// kinds of elements file arguments are compiled into
+enum token_type
+{
+    LITERAL, ANY_CHAR, ANY_STRING, CHAR_CLASS, FINAL
+};
+
+// element of a compiled pattern, its index is the state of the automaton before it is matched,
+// FINAL follows the last element of every pattern
+struct Token
+{
+    enum token_type type;
+    unsigned char c;                // LITERAL
+    int pattern;                    // FINAL, index of the argument
+    uint64_t class[4];              // CHAR_CLASS, bitmap of matched bytes
+};
+
+// state of the matching automaton, the set of token indices that can be reached by the name read so far
+struct MatchState
+{
+    uint32_t set;                   // offset of the sorted set in pool
+    uint32_t length;                // empty set is the dead state, nothing can match any more
+    bool accepting;                 // some pattern is matched completely
+    bool marked;                    // all patterns it matches were found already
+};
+
+// file arguments compiled into one automaton, each name is matched in a single pass over it
+// whatever the number of arguments, its states are made when a name first gets to them
+struct FileSet
+{
+    char **names;
+    int count;
+    int missing;                    // number of names not found in the archive yet
+    bool *found;                    // which names were found in the archive
+    bool wildcards;                 // names are patterns
+    struct Token *tokens;
+    long tokens_count;
+    long tokens_capacity;
+    uint32_t *pool;                 // token sets of all states
+    long pool_length;
+    long pool_capacity;
+    struct MatchState *states;
+    long states_count;
+    long states_capacity;
+    long states_limit;              // MATCH_STATES_LIMIT, unless --max-memory is too small for its tables
+    uint32_t *state_slots;          // 1-based state indices hashed by their sets, 0 if empty
+    unsigned long state_mask;
+    uint64_t *transition_keys;      // (state << 8 | byte) + 1, 0 if empty
+    uint32_t *transition_targets;
+    unsigned long transition_mask;
+    long transitions_count;
+    uint32_t *scratch;              // set being built
+    long scratch_length;
+    uint32_t *seen;                 // generation in which a token was added to scratch
+    uint32_t generation;
+    bool directory_matched;         // some argument selected a name below it, so it is a directory
+    bool below;                     // the last name matched is below one of the arguments
+};
+
+// index sidecar file layout:
+// struct IndexHeader, uint32_t buckets[buckets_count], struct IndexEntry entries[entries_count], names
+// bucket holds 1-based index of the first entry of its chain (0 if empty),
+// chains are in archive order
+struct IndexHeader
+{
+    char magic[8];
+    int64_t archive_size;           // archive the index was built for, used to detect stale index
+    int64_t archive_mtime;
+    uint32_t entries_count;
+    uint32_t buckets_count;         // power of two
+};
+
+struct IndexEntry
+{
+    int64_t offset;                 // archive offset of member header
+    int64_t size;
+    int64_t mtime;
+    uint64_t hash;                  // XXH64 of member data, 0 if it was not hashed
+    uint32_t name;                  // offset of zero terminated name in names
+    uint32_t next;                  // 1-based index of the next entry in chain, 0 at the end
+};
+
+// read-only view of a mapped index sidecar
+struct Index
+{
+    char *map;
+    long size;
+    struct IndexHeader *header;
+    uint32_t *buckets;
+    struct IndexEntry *entries;
+    char *names;
+    long names_size;
+};
+
+// XXH64 with seed 0 computed over data given in pieces of any size
+struct Hasher
+{
+    uint64_t lanes[4];
+    unsigned char pending[XXH_STRIPE];  // start of a stripe not complete yet
+    int pending_size;
+    long total;
+};
+
+// entries collected while scanning the archive
+struct IndexBuilder
+{
+    struct IndexEntry *entries;
+    long entries_count;
+    long entries_capacity;
+    char *names;
+    long names_size;
+    long names_capacity;
+};
+
 enum mode
 {
-    LIST, EXTRACT
+    LIST, EXTRACT, CREATE, APPEND, UPDATE, COMPARE
+};
+
+// archive being written, output is collected into whole records
+struct Writer
+{
+    int fd;
+    char *buffer;
+    long record_size;
+    long used;                      // bytes in buffer
+    long offset;                    // archive size including buffered bytes
+};
+
+// file on its way from traversal to the archive writer
+struct CreateItem
+{
+    char path[PATH_MAX];            // path on disk
+    char name[PATH_MAX + 2];        // member name, that of a directory ends with a slash
+    char *link;                     // target of a symbolic link, NULL for other files
+    struct statx stx;               // size is 0 unless it is a regular file
+    char *data;                     // prefetched contents, NULL if the writer streams them from fd
+    int fd;                         // open file of a large member, -1 otherwise
+    bool loaded;                    // prefetch is done, item may be written
+    bool failed;                    // file couldn't be read, it is not archived
+};
+
+// existing archive that new members are added to with -r or -u
+struct Update
+{
+    long end;                       // offset of the end-of-archive blocks, which are overwritten
+    struct Index *members;          // members already in the archive, NULL if every file is added
+    struct IndexBuilder *added;     // members written now, NULL unless the index is kept up to date
+};
+
+// three stage pipeline: traversal thread walks directories and calls statx,
+// prefetch threads read contents of small files, the main thread writes
+// items to the archive strictly in traversal order
+// items live in a ring: [written, loading) are being prefetched or wait to be written,
+// [loading, queued) wait for a prefetch thread
+struct Creator
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct CreateItem items[CREATE_QUEUE_LENGTH];
+    long queued;                    // number of items added by traversal
+    long loading;                   // number of items taken by prefetch threads
+    long written;                   // number of items written to the archive
+    bool traversed;                 // traversal added its last item
+    bool failed;                    // some file couldn't be archived
+    char **paths;
+    int paths_count;
+    bool stripped;                  // leading slash was removed from some member name
+    struct stat archive;            // archive itself is not added to itself
+    uid_t uid;                      // cached user and group names for the last owner seen
+    gid_t gid;
+    char uname[32];
+    char gname[32];
+    struct Update *update;          // NULL when a new archive is created
+};
+
+// thread searching one chunk of a mapped archive for headers, a chunk may start inside data
+// of a member, so what looks like a header there need not be one
+struct Scanner
+{
+    pthread_t thread;
+    struct Reader *reader;
+    long start;
+    long end;
+    long *candidates;               // offsets of headers found, in archive order
+    long count;
+    long capacity;
+    long cursor;                    // candidates before it are behind the chain being stitched
+};
+
+// how members are printed by listing and verbose extraction
+enum listing
+{
+    PLAIN,                          // name per line
+    JSON_LINES,                     // object with name, type, size, mtime, mode and offset per line
+    NUL_DELIMITED                   // "size mtime mode offset name" terminated by zero byte
+};
+
+// settings from the command line that affect processing of the archive
+struct Options
+{
+    enum mode action;
+    bool verbose;
+    int jobs;                       // number of threads writing extracted files
+    char *index_path;               // index sidecar to use or build, NULL if not requested
+    bool occurrence;                // stop reading once all file arguments were found
+    bool verify_checksum;           // check every header against its checksum
+    bool uring;                     // create small extracted files through io_uring
+    enum listing listing;
+    bool wildcards;                 // file arguments are shell patterns
+    char *directory;                // files are extracted there, NULL for the current directory
+    bool hash;                      // data of listed members is hashed instead of skipped
 };
 
-// computes decimal number from string representation of octal number
-long oct2dec(char *octal)
+// counters reported by --stats, writer and decompression threads update them too,
+// times are in nanoseconds and summed over threads
+struct Stats
+{
+    bool enabled;
+    long entries;                   // members scanned, extended headers not included
+    long extracted;                 // bytes of member data written to files
+    long skipped;                   // bytes of member data passed over
+    long hashed;                    // bytes of member data hashed for the listing
+    long syscalls;
+    long header_time;               // reading and parsing headers
+    long skip_time;
+    long hash_time;
+    long create_time;               // creating files, directories and links
+    long write_time;                // copying member data to files
+    long print_time;                // listing output
+    long throttle_time;             // waiting for --rate and --iops
+};
+
+struct Stats stats;
+
+// resource bounds of extraction, shared by the reader, the decompressor, writer threads and io_uring,
+// zero means unlimited, so the library and a command without the options never wait
+struct Limits
+{
+    long memory;                    // --max-memory, buffers of the reader, volumes and file set plus member data queued
+    long rate;                      // --rate, bytes per second read from the archive or written to files
+    long iops;                      // --iops, reads, writes and creations per second
+    long open_files;                // --max-open, output files open at once
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // signalled when queued data or open files are given back
+    long bytes_ready;               // time when the next operation fits the rate
+    long ops_ready;                 // time when the next operation fits the IOPS limit
+    long queued;                    // member data queued for writer threads
+    long opened;                    // output files being written
+};
+
+struct Limits limits = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+__thread struct Trap *trap;         // set while a library call or the decompressor thread reads
+__thread FILE *report;              // output of the member being compared, NULL for stdout
+
+void count_syscalls(long count)
+{
+    if (stats.enabled)
+    {
+        __atomic_add_fetch(&stats.syscalls, count, __ATOMIC_RELAXED);
+    }
+}
+
+// returns current time for measuring a phase, nothing is measured unless --stats is given
+long stats_clock(void)
 {
-    long decimal = 0;
-    long radix = 1;
-    int length = strlen(octal);
+    struct timespec now;
 
-    for (int i = length - 1; i >= 0; i--)
+    if (!stats.enabled)
     {
-        decimal += (octal[i] - '0') * radix;
-        radix *= 8;
+        return 0;
     }
-    return decimal;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
 }
 
-long get_archive_size(FILE *fin)
+void add_stat(long *counter, long value)
 {
-    fseek(fin, 0, SEEK_END);
-    long size = ftell(fin);
-    fseek(fin, 0, SEEK_SET);
-    return size;
+    if (stats.enabled)
+    {
+        __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+    }
 }
 
-// returns true if block contains only zero bytes
-bool is_empty_block(char *buffer)
+// adds time elapsed since start to one of the phases
+void add_time(long *counter, long start)
 {
-    for (int i = 0; i < BLOCK_SIZE; i++)
+    if (stats.enabled)
+    {
+        add_stat(counter, stats_clock() - start);
+    }
+}
+
+// waits until an operation moving bytes fits --rate and --iops, operations are paced one after
+// another by reserving their share of both, time without any I/O is not saved up for bursts
+void throttle(long bytes, long ops)
+{
+    struct timespec now;
+
+    if (limits.rate == 0 && limits.iops == 0)
     {
-        if (buffer[i] != '\0')
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long started = now.tv_sec * 1000000000L + now.tv_nsec;
+
+    pthread_mutex_lock(&limits.lock);
+
+    limits.bytes_ready = limits.bytes_ready > started ? limits.bytes_ready : started;
+    limits.ops_ready = limits.ops_ready > started ? limits.ops_ready : started;
+
+    long ready = limits.bytes_ready > limits.ops_ready ? limits.bytes_ready : limits.ops_ready;
+
+    if (limits.rate > 0)
+    {
+        limits.bytes_ready += (long)(bytes * 1e9 / limits.rate);
+    }
+    if (limits.iops > 0)
+    {
+        limits.ops_ready += ops * 1000000000L / limits.iops;
+    }
+
+    pthread_mutex_unlock(&limits.lock);
+
+    if (ready > started)
+    {
+        struct timespec until = { ready / 1000000000L, ready % 1000000000L };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
         {
-            return false;
         }
+        add_stat(&stats.throttle_time, ready - started);
     }
+}
 
-    return true;
+// size of the next transfer of at most size bytes, under --rate large ones are split
+long throttled_size(long size)
+{
+    return limits.rate > 0 && size > THROTTLE_CHUNK ? THROTTLE_CHUNK : size;
 }
 
-// check "magic" field in header
-void is_tar_archive(struct Header *header)
+// waits while member data queued for writing would exceed --max-memory,
+// a member larger than the limit is only queued when nothing else is
+void reserve_memory(long size)
 {
-    if (strcmp(header->magic, MAGIC) != 0)
+    if (limits.memory == 0)
     {
-        warnx("This does not look like a tar archive");
-        errx(2, "Exiting with failure status due to previous errors");
+        return;
+    }
+
+    pthread_mutex_lock(&limits.lock);
+
+    while (limits.queued > 0 && limits.queued + size > limits.memory)
+    {
+        pthread_cond_wait(&limits.changed, &limits.lock);
+    }
+    limits.queued += size;
+
+    pthread_mutex_unlock(&limits.lock);
+}
+
+void release_memory(long size)
+{
+    if (limits.memory == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&limits.lock);
+    limits.queued -= size;
+    pthread_cond_broadcast(&limits.changed);
+    pthread_mutex_unlock(&limits.lock);
+}
+
+// waits for a free place among output files open at once under --max-open
+void acquire_file(void)
+{
+    if (limits.open_files == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&limits.lock);
+
+    while (limits.opened == limits.open_files)
+    {
+        pthread_cond_wait(&limits.changed, &limits.lock);
+    }
+    limits.opened++;
+
+    pthread_mutex_unlock(&limits.lock);
+}
+
+void release_file(void)
+{
+    if (limits.open_files == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&limits.lock);
+    limits.opened--;
+    pthread_cond_broadcast(&limits.changed);
+    pthread_mutex_unlock(&limits.lock);
+}
+
+// reports an error in reading the archive and exits, a trapped one is returned to the caller instead
+__attribute__((noreturn, format(printf, 1, 2)))
+void fail(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+
+    // listing buffered so far comes before the error, as it was read before it
+    if (trap == NULL)
+    {
+        fflush(stdout);
+        verrx(2, format, args);
+    }
+
+    vsnprintf(trap->message, sizeof(trap->message), format, args);
+    va_end(args);
+    trap->conclusion = NULL;
+    longjmp(trap->jump, 1);
+}
+
+// error tar reports with a conclusion on the next line, a trapped one keeps both
+__attribute__((noreturn))
+void fatal(char *message, char *conclusion)
+{
+    if (trap == NULL)
+    {
+        fflush(stdout);
+        warnx("%s", message);
+        errx(2, "%s", conclusion);
+    }
+
+    snprintf(trap->message, sizeof(trap->message), "%s", message);
+    trap->conclusion = conclusion;
+    longjmp(trap->jump, 1);
+}
+
+// raises an error caught by another thread again in this one
+__attribute__((noreturn))
+void rethrow(struct Trap *caught)
+{
+    if (caught->conclusion != NULL)
+    {
+        fatal(caught->message, caught->conclusion);
+    }
+    fail("%s", caught->message);
+}
+
+// parses numeric header field of given width, fields need not be zero terminated
+// octal digits may be preceded by spaces and end with space or zero byte,
+// if the high bit of the first byte is set, the rest is a big-endian binary number
+// (GNU base-256 encoding, used for sizes of 8 GiB and more), 0xff marks a negative one
+long parse_number(char *field, int width)
+{
+    unsigned char *bytes = (unsigned char*)field;
+    unsigned long value = 0;
+    int i = 0;
+
+    if (bytes[0] & 0x80)
+    {
+        // remaining 7 bits of the first byte are two's complement, 0x40 is the sign
+        long binary = (bytes[0] & 0x40) ? (bytes[0] & 0x7f) - 0x80 : (bytes[0] & 0x7f);
+
+        for (i = 1; i < width; i++)
+        {
+            if (binary > LONG_MAX / 256 || binary < LONG_MIN / 256)
+            {
+                fail("Numeric field out of range");
+            }
+            binary = binary * 256 + bytes[i];
+        }
+
+        return binary;
+    }
+
+    while (i < width && bytes[i] == ' ')
+    {
+        i++;
+    }
+
+    // 12 octal digits take 36 bits, so shifting can't overflow
+    for (; i < width && (unsigned char)(bytes[i] - '0') < 8; i++)
+    {
+        value = value << 3 | (bytes[i] - '0');
+    }
+
+    return (long)value;
+}
+
+// parses size field, negative size can't come from a sane archive
+long member_size(struct Header *header)
+{
+    long size = parse_number(header->size, sizeof(header->size));
+
+    if (size < 0)
+    {
+        fail("Invalid size field in header");
+    }
+    return size;
+}
+
+// returns size of a seekable archive, -1 for pipes and other streams
+long get_archive_size(int fd)
+{
+    long size = lseek(fd, 0, SEEK_END);
+
+    if (size >= 0)
+    {
+        lseek(fd, 0, SEEK_SET);
+    }
+    return size;
+}
+
+void unexpected_eof(void)
+{
+    fatal("Unexpected EOF in archive", "Error is not recoverable: exiting now");
+}
+
+void *prefetch_volume(void *arg)
+{
+    struct Volumes *volumes = arg;
+    char *name = volumes->names[volumes->current + 1];
+
+    volumes->next_fd = open(name, O_RDONLY);
+    volumes->next_length = 0;
+    count_syscalls(1);
+
+    if (volumes->next_fd < 0)
+    {
+        errx(2, "%s: Cannot open volume", name);
+    }
+
+    while (volumes->next_length < volumes->prefetch)
+    {
+        ssize_t bytes = read(volumes->next_fd, volumes->next_data + volumes->next_length,
+                             throttled_size(volumes->prefetch - volumes->next_length));
+        count_syscalls(1);
+        throttle(bytes > 0 ? bytes : 0, 1);
+
+        if (bytes < 0)
+        {
+            errx(2, "Error reading archive");
+        }
+        if (bytes == 0)
+        {
+            break;
+        }
+        volumes->next_length += bytes;
+    }
+
+    return NULL;
+}
+
+void start_prefetch(struct Volumes *volumes)
+{
+    volumes->prefetching = volumes->current + 1 < volumes->count;
+
+    if (volumes->prefetching && pthread_create(&volumes->thread, NULL, prefetch_volume, volumes) != 0)
+    {
+        errx(2, "pthread_create");
+    }
+}
+
+// switches to the volume prefetched in the background and starts on the one after it,
+// returns false after the last volume
+bool next_volume(struct Volumes *volumes)
+{
+    if (!volumes->prefetching)
+    {
+        return false;
+    }
+
+    pthread_join(volumes->thread, NULL);
+
+    if (volumes->fd >= 0)
+    {
+        close(volumes->fd);
+    }
+
+    char *data = volumes->data;
+
+    volumes->fd = volumes->next_fd;
+    volumes->data = volumes->next_data;
+    volumes->next_data = data;
+    volumes->length = volumes->next_length;
+    volumes->position = 0;
+    volumes->current++;
+
+    start_prefetch(volumes);
+    return true;
+}
+
+void open_volumes(struct Volumes *volumes, char **names, int count)
+{
+    volumes->names = names;
+    volumes->count = count;
+    volumes->current = -1;
+    volumes->fd = -1;
+    volumes->length = 0;
+    volumes->position = 0;
+    volumes->prefetch = VOLUME_PREFETCH;
+
+    // both buffers fit in their share of --max-memory
+    if (limits.memory > 0 && 2 * volumes->prefetch > limits.memory / MEMORY_SHARE)
+    {
+        volumes->prefetch = limits.memory / MEMORY_SHARE / 2 / BLOCK_SIZE * BLOCK_SIZE;
+        volumes->prefetch = volumes->prefetch > BLOCK_SIZE ? volumes->prefetch : BLOCK_SIZE;
+    }
+
+    volumes->data = malloc(volumes->prefetch);
+    volumes->next_data = malloc(volumes->prefetch);
+
+    if (volumes->data == NULL || volumes->next_data == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    // the first volume is waited for, the rest of them is prefetched
+    start_prefetch(volumes);
+    next_volume(volumes);
+}
+
+void close_volumes(struct Volumes *volumes)
+{
+    if (volumes->prefetching)
+    {
+        pthread_join(volumes->thread, NULL);
+        close(volumes->next_fd);
+    }
+    if (volumes->fd >= 0)
+    {
+        close(volumes->fd);
+    }
+    free(volumes->data);
+    free(volumes->next_data);
+}
+
+// reads from the current volume, an empty read moves to the next one,
+// prefetched data was paced by --rate and --iops when it was read
+ssize_t read_volumes(struct Volumes *volumes, char *data, long size)
+{
+    while (true)
+    {
+        if (volumes->position < volumes->length)
+        {
+            long count = volumes->length - volumes->position < size ? volumes->length - volumes->position : size;
+
+            memcpy(data, volumes->data + volumes->position, count);
+            volumes->position += count;
+            return count;
+        }
+
+        ssize_t bytes = read(volumes->fd, data, size);
+        count_syscalls(1);
+        throttle(bytes > 0 ? bytes : 0, 1);
+
+        if (bytes != 0 || !next_volume(volumes))
+        {
+            return bytes;
+        }
+    }
+}
+
+// reads from the archive file or from the sequence of its volumes
+ssize_t read_input(int fd, struct Volumes *volumes, char *data, long size)
+{
+    if (volumes != NULL)
+    {
+        return read_volumes(volumes, data, size);
+    }
+
+    ssize_t bytes = read(fd, data, size);
+    count_syscalls(1);
+    throttle(bytes > 0 ? bytes : 0, 1);
+    return bytes;
+}
+
+// recognizes compressed archive by its first bytes
+enum compression detect_compression(unsigned char *magic, long length)
+{
+    if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        return GZIP;
+    }
+    if (length >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    {
+        return ZSTD;
+    }
+    return NONE;
+}
+
+// reads next compressed input, returns false at the end of it
+bool read_compressed(struct Decompressor *decompressor)
+{
+    ssize_t bytes = read_input(decompressor->fd, decompressor->volumes, decompressor->input, decompressor->input_size);
+
+    if (bytes < 0)
+    {
+        fail("Error reading archive");
+    }
+    decompressor->input_length = bytes;
+    return bytes > 0;
+}
+
+void corrupted_stream(void)
+{
+    fatal("Compressed archive is damaged or truncated", "Error is not recoverable: exiting now");
+}
+
+// fills chunk with decompressed data, returns its length, which is less than
+// the chunk size only at the end of the stream
+// concatenated gzip members are decompressed one after another,
+// anything else following a member (e.g. padding of the last record) is ignored
+long inflate_chunk(struct Decompressor *decompressor, char *chunk)
+{
+    z_stream *stream = &decompressor->gzip;
+
+    stream->next_out = (Bytef*)chunk;
+    stream->avail_out = decompressor->chunk_size;
+
+    while (stream->avail_out > 0 && !decompressor->ended)
+    {
+        if (stream->avail_in == 0)
+        {
+            if (!read_compressed(decompressor))
+            {
+                corrupted_stream();
+            }
+            stream->next_in = (Bytef*)decompressor->input;
+            stream->avail_in = decompressor->input_length;
+        }
+
+        int result = inflate(stream, Z_NO_FLUSH);
+
+        if (result == Z_STREAM_END)
+        {
+            if (stream->avail_in == 0 && !read_compressed(decompressor))
+            {
+                decompressor->ended = true;
+                break;
+            }
+            if (stream->avail_in == 0)
+            {
+                stream->next_in = (Bytef*)decompressor->input;
+                stream->avail_in = decompressor->input_length;
+            }
+            if (stream->next_in[0] != 0x1f)
+            {
+                decompressor->ended = true;
+                break;
+            }
+            inflateReset(stream);
+        }
+        else if (result != Z_OK && result != Z_BUF_ERROR)
+        {
+            corrupted_stream();
+        }
+    }
+
+    return decompressor->chunk_size - stream->avail_out;
+}
+
+// zstd counterpart of inflate_chunk, frames following each other are decompressed
+// by the same stream
+long zstd_chunk(struct Decompressor *decompressor, char *chunk)
+{
+    ZSTD_inBuffer *input = &decompressor->zstd_input;
+    ZSTD_outBuffer output = { chunk, decompressor->chunk_size, 0 };
+
+    while (output.pos < output.size && !decompressor->ended)
+    {
+        if (input->pos == input->size)
+        {
+            if (!read_compressed(decompressor))
+            {
+                if (decompressor->zstd_pending != 0)
+                {
+                    corrupted_stream();
+                }
+                decompressor->ended = true;
+                break;
+            }
+            input->src = decompressor->input;
+            input->size = decompressor->input_length;
+            input->pos = 0;
+        }
+
+        decompressor->zstd_pending = ZSTD_decompressStream(decompressor->zstd, &output, input);
+
+        if (ZSTD_isError(decompressor->zstd_pending))
+        {
+            corrupted_stream();
+        }
+    }
+
+    return output.pos;
+}
+
+void decompress_chunks(struct Decompressor *decompressor)
+{
+    bool finished = false;
+
+    while (!finished)
+    {
+        pthread_mutex_lock(&decompressor->lock);
+
+        while (decompressor->produced - decompressor->consumed == DECOMPRESS_CHUNKS && !decompressor->stopped)
+        {
+            pthread_cond_wait(&decompressor->changed, &decompressor->lock);
+        }
+
+        if (decompressor->stopped)
+        {
+            pthread_mutex_unlock(&decompressor->lock);
+            break;
+        }
+
+        long slot = decompressor->produced % DECOMPRESS_CHUNKS;
+
+        pthread_mutex_unlock(&decompressor->lock);
+
+        long length = decompressor->compression == GZIP
+                      ? inflate_chunk(decompressor, decompressor->chunks[slot])
+                      : zstd_chunk(decompressor, decompressor->chunks[slot]);
+
+        finished = length < decompressor->chunk_size;
+
+        pthread_mutex_lock(&decompressor->lock);
+        decompressor->lengths[slot] = length;
+        decompressor->produced++;
+        decompressor->finished = finished;
+        pthread_cond_signal(&decompressor->changed);
+        pthread_mutex_unlock(&decompressor->lock);
+    }
+}
+
+// errors of the thread don't end the process, they are handed to the reader
+void *decompress_main(void *arg)
+{
+    struct Decompressor *decompressor = arg;
+
+    trap = &decompressor->trap;
+
+    if (setjmp(decompressor->trap.jump) != 0)
+    {
+        pthread_mutex_lock(&decompressor->lock);
+        decompressor->failed = true;
+        decompressor->finished = true;
+        pthread_cond_signal(&decompressor->changed);
+        pthread_mutex_unlock(&decompressor->lock);
+        return NULL;
+    }
+
+    decompress_chunks(decompressor);
+    return NULL;
+}
+
+void run_decompressor(struct Decompressor *decompressor)
+{
+    decompressor->stopped = false;
+
+    if (pthread_create(&decompressor->thread, NULL, decompress_main, decompressor) != 0)
+    {
+        fail("pthread_create");
+    }
+}
+
+// waits for the thread to finish the chunk it is working on and stops it
+void halt_decompressor(struct Decompressor *decompressor)
+{
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->stopped = true;
+    pthread_cond_signal(&decompressor->changed);
+    pthread_mutex_unlock(&decompressor->lock);
+
+    pthread_join(decompressor->thread, NULL);
+}
+
+// reads seek table of a seekable zstd archive, leaves frames_count 0 if there is none
+// a table that doesn't describe frames filling the file up to itself is ignored
+void read_seek_table(struct Decompressor *decompressor, long file_size)
+{
+    unsigned char footer[SEEK_FOOTER_SIZE];
+    unsigned char skippable[8];
+
+    if (file_size < SEEK_FOOTER_SIZE + 8
+        || pread(decompressor->fd, footer, sizeof(footer), file_size - SEEK_FOOTER_SIZE) != sizeof(footer))
+    {
+        return;
+    }
+
+    uint32_t count = footer[0] | footer[1] << 8 | footer[2] << 16 | (uint32_t)footer[3] << 24;
+    uint32_t magic = footer[5] | footer[6] << 8 | footer[7] << 16 | (uint32_t)footer[8] << 24;
+    long entry_size = (footer[4] & SEEK_CHECKSUM_FLAG) ? 12 : 8;
+    long table_size = count * entry_size + SEEK_FOOTER_SIZE;
+    long table_start = file_size - table_size;          // entries, the skippable frame header precedes them
+
+    if (magic != SEEKABLE_MAGIC || count == 0 || table_start < 8
+        || pread(decompressor->fd, skippable, sizeof(skippable), table_start - 8) != sizeof(skippable))
+    {
+        return;
+    }
+
+    uint32_t frame_magic = skippable[0] | skippable[1] << 8 | skippable[2] << 16 | (uint32_t)skippable[3] << 24;
+    uint32_t frame_size = skippable[4] | skippable[5] << 8 | skippable[6] << 16 | (uint32_t)skippable[7] << 24;
+    unsigned char *entries = malloc(table_size);
+    struct Frame *frames = malloc(sizeof(struct Frame) * (count + 1));
+
+    if (entries == NULL || frames == NULL)
+    {
+        fail("malloc");
+    }
+
+    if (frame_magic != SKIPPABLE_MAGIC || frame_size != table_size
+        || pread(decompressor->fd, entries, table_size, table_start) != table_size)
+    {
+        free(entries);
+        free(frames);
+        return;
+    }
+
+    frames[0].compressed = 0;
+    frames[0].offset = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        unsigned char *entry = entries + i * entry_size;
+
+        frames[i + 1].compressed = frames[i].compressed
+                                   + (entry[0] | entry[1] << 8 | entry[2] << 16 | (uint32_t)entry[3] << 24);
+        frames[i + 1].offset = frames[i].offset
+                               + (entry[4] | entry[5] << 8 | entry[6] << 16 | (uint32_t)entry[7] << 24);
+    }
+
+    free(entries);
+
+    if (frames[count].compressed != table_start - 8)
+    {
+        free(frames);
+        return;
+    }
+
+    decompressor->frames = frames;
+    decompressor->frames_count = count;
+}
+
+// returns index of the frame holding the byte at offset of the tar stream
+long find_frame(struct Decompressor *decompressor, long offset)
+{
+    long low = 0;
+    long high = decompressor->frames_count - 1;
+
+    while (low < high)
+    {
+        long middle = (low + high + 1) / 2;
+
+        if (decompressor->frames[middle].offset <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// throws away everything decompressed so far and restarts decompression at given frame
+void seek_frame(struct Decompressor *decompressor, long frame)
+{
+    halt_decompressor(decompressor);
+
+    decompressor->produced = 0;
+    decompressor->consumed = 0;
+    decompressor->position = 0;
+    decompressor->finished = false;
+    decompressor->failed = false;
+    decompressor->ended = false;
+    decompressor->input_length = 0;
+    decompressor->zstd_input.size = 0;
+    decompressor->zstd_input.pos = 0;
+    decompressor->zstd_pending = 1;
+    ZSTD_DCtx_reset(decompressor->zstd, ZSTD_reset_session_only);
+
+    count_syscalls(1);
+
+    if (lseek(decompressor->fd, decompressor->frames[frame].compressed, SEEK_SET) < 0)
+    {
+        fail("Error reading archive");
+    }
+
+    run_decompressor(decompressor);
+}
+
+// starts decompressing what follows magic, which was already read from fd
+struct Decompressor *start_decompressor(int fd, struct Volumes *volumes, enum compression compression, char *magic,
+                                        long magic_length, long chunk_size)
+{
+    struct Decompressor *decompressor = calloc(1, sizeof(struct Decompressor));
+
+    if (decompressor == NULL)
+    {
+        fail("calloc");
+    }
+
+    decompressor->fd = fd;
+    decompressor->volumes = volumes;
+    decompressor->compression = compression;
+    decompressor->chunk_size = chunk_size;
+    decompressor->input_size = chunk_size;
+    decompressor->input = malloc(chunk_size);
+
+    for (int i = 0; i < DECOMPRESS_CHUNKS; i++)
+    {
+        decompressor->chunks[i] = malloc(chunk_size);
+
+        if (decompressor->chunks[i] == NULL)
+        {
+            fail("malloc");
+        }
+    }
+
+    if (decompressor->input == NULL)
+    {
+        fail("malloc");
+    }
+
+    memcpy(decompressor->input, magic, magic_length);
+    decompressor->input_length = magic_length;
+
+    if (compression == GZIP)
+    {
+        decompressor->gzip.next_in = (Bytef*)decompressor->input;
+        decompressor->gzip.avail_in = magic_length;
+
+        // 16 + window bits: expect gzip header
+        if (inflateInit2(&decompressor->gzip, 16 + MAX_WBITS) != Z_OK)
+        {
+            fail("inflateInit2");
+        }
+    }
+    else
+    {
+        decompressor->zstd = ZSTD_createDCtx();
+
+        if (decompressor->zstd == NULL)
+        {
+            fail("ZSTD_createDCtx");
+        }
+
+        decompressor->zstd_input.src = decompressor->input;
+        decompressor->zstd_input.size = magic_length;
+        decompressor->zstd_input.pos = 0;
+        decompressor->zstd_pending = 1;
+    }
+
+    pthread_mutex_init(&decompressor->lock, NULL);
+    pthread_cond_init(&decompressor->changed, NULL);
+    run_decompressor(decompressor);
+
+    return decompressor;
+}
+
+// copies up to size decompressed bytes to data, returns 0 at the end of the stream
+// error of the thread is raised once everything decompressed before it was read
+long read_decompressed(struct Decompressor *decompressor, char *data, long size)
+{
+    pthread_mutex_lock(&decompressor->lock);
+
+    while (decompressor->consumed == decompressor->produced && !decompressor->finished)
+    {
+        pthread_cond_wait(&decompressor->changed, &decompressor->lock);
+    }
+
+    if (decompressor->consumed == decompressor->produced)
+    {
+        pthread_mutex_unlock(&decompressor->lock);
+
+        if (decompressor->failed)
+        {
+            rethrow(&decompressor->trap);
+        }
+        return 0;
+    }
+
+    long slot = decompressor->consumed % DECOMPRESS_CHUNKS;
+
+    pthread_mutex_unlock(&decompressor->lock);
+
+    long available = decompressor->lengths[slot] - decompressor->position;
+    long count = available < size ? available : size;
+
+    memcpy(data, decompressor->chunks[slot] + decompressor->position, count);
+    decompressor->position += count;
+
+    // oldest chunk is used up, give it back to the thread
+    if (decompressor->position == decompressor->lengths[slot])
+    {
+        pthread_mutex_lock(&decompressor->lock);
+        decompressor->consumed++;
+        decompressor->position = 0;
+        pthread_cond_signal(&decompressor->changed);
+        pthread_mutex_unlock(&decompressor->lock);
+    }
+
+    return count;
+}
+
+// stops the thread even if the stream wasn't read to its end
+void stop_decompressor(struct Decompressor *decompressor)
+{
+    halt_decompressor(decompressor);
+
+    if (decompressor->compression == GZIP)
+    {
+        inflateEnd(&decompressor->gzip);
+    }
+    else
+    {
+        ZSTD_freeDCtx(decompressor->zstd);
+    }
+
+    for (int i = 0; i < DECOMPRESS_CHUNKS; i++)
+    {
+        free(decompressor->chunks[i]);
+    }
+
+    pthread_mutex_destroy(&decompressor->lock);
+    pthread_cond_destroy(&decompressor->changed);
+    free(decompressor->frames);
+    free(decompressor->input);
+    free(decompressor);
+}
+
+// maps the archive if it is a regular file, otherwise allocates the record buffer
+// compressed archive is never mapped, it is decompressed into the record buffer
+// archive is a single file fd, or it is split into volumes and fd is -1
+void open_reader(struct Reader *reader, int fd, struct Volumes *volumes, int blocking_factor)
+{
+    struct stat st;
+    char magic[MAGIC_LENGTH];
+    long magic_length = 0;
+
+    reader->fd = fd;
+    reader->volumes = volumes;
+    reader->decompressor = NULL;
+    reader->null_fd = -1;
+    reader->mapped = false;
+    reader->map = NULL;
+    reader->offset = 0;
+    reader->buffer = NULL;
+    reader->record_size = (long)blocking_factor * BLOCK_SIZE;
+    reader->buffer_start = 0;
+    reader->buffer_end = 0;
+
+    // volumes are read as a stream, the archive can't be mapped or seeked as a whole
+    bool regular = volumes == NULL && fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    // size is found out while the descriptor is still at the start of the archive
+    reader->size = regular ? st.st_size : volumes == NULL ? get_archive_size(reader->fd) : -1;
+    reader->mtime = regular ? st.st_mtime : 0;
+
+    while (magic_length < MAGIC_LENGTH)
+    {
+        ssize_t bytes = read_input(reader->fd, volumes, magic + magic_length, MAGIC_LENGTH - magic_length);
+
+        if (bytes <= 0)
+        {
+            break;
+        }
+        magic_length += bytes;
+    }
+
+    enum compression compression = detect_compression((unsigned char*)magic, magic_length);
+
+    if (regular && compression == NONE)
+    {
+        reader->mapped = true;
+
+        if (reader->size > 0)
+        {
+            reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+
+            if (reader->map == MAP_FAILED)
+            {
+                reader->map = NULL;
+                reader->mapped = false;
+            }
+            else
+            {
+                madvise(reader->map, reader->size, MADV_SEQUENTIAL);
+            }
+        }
+    }
+
+    if (!reader->mapped)
+    {
+        if (posix_memalign((void**)&reader->buffer, BUFFER_ALIGNMENT, reader->record_size) != 0)
+        {
+            fail("posix_memalign");
+        }
+    }
+
+    if (!reader->mapped && compression != NONE)
+    {
+        reader->decompressor = start_decompressor(reader->fd, volumes, compression, magic, magic_length,
+                                                  reader->record_size);
+
+        if (regular && compression == ZSTD)
+        {
+            read_seek_table(reader->decompressor, reader->size);
+        }
+    }
+    else if (!reader->mapped)
+    {
+        memcpy(reader->buffer, magic, magic_length);
+        reader->buffer_end = magic_length;
+    }
+}
+
+void close_reader(struct Reader *reader)
+{
+    if (reader->map != NULL)
+    {
+        munmap(reader->map, reader->size);
+    }
+    if (reader->decompressor != NULL)
+    {
+        stop_decompressor(reader->decompressor);
+    }
+    if (reader->null_fd >= 0)
+    {
+        close(reader->null_fd);
+    }
+    free(reader->buffer);
+}
+
+// reads next records until at least one whole block is buffered or EOF is reached
+// returns number of buffered bytes
+long fill_buffer(struct Reader *reader)
+{
+    long buffered = reader->buffer_end - reader->buffer_start;
+
+    if (buffered >= BLOCK_SIZE)
+    {
+        return buffered;
+    }
+
+    // move incomplete block left over from a short read to the start
+    memmove(reader->buffer, reader->buffer + reader->buffer_start, buffered);
+    reader->buffer_start = 0;
+    reader->buffer_end = buffered;
+
+    while (reader->buffer_end < BLOCK_SIZE)
+    {
+        char *data = reader->buffer + reader->buffer_end;
+        long size = reader->record_size - reader->buffer_end;
+        ssize_t bytes = reader->decompressor != NULL
+                        ? read_decompressed(reader->decompressor, data, size)
+                        : read_input(reader->fd, reader->volumes, data, size);
+
+        if (bytes < 0)
+        {
+            fail("Error reading archive");
+        }
+        if (bytes == 0)
+        {
+            break;
+        }
+        reader->buffer_end += bytes;
+    }
+
+    return reader->buffer_end;
+}
+
+// returns pointer to at most max buffered bytes and consumes them,
+// *count is set to the number of bytes available (zero at EOF)
+char *take_bytes(struct Reader *reader, long max, long *count)
+{
+    long buffered = reader->buffer_end - reader->buffer_start;
+
+    if (buffered == 0)
+    {
+        buffered = fill_buffer(reader);
+    }
+
+    char *data = reader->buffer + reader->buffer_start;
+
+    *count = buffered < max ? buffered : max;
+    reader->buffer_start += *count;
+    reader->offset += *count;
+    return data;
+}
+
+// returns pointer to the next block of the archive or NULL if there is no whole block left
+// the block stays valid until the next call
+char *read_block(struct Reader *reader)
+{
+    char *block;
+
+    if (reader->mapped)
+    {
+        if (reader->size - reader->offset < BLOCK_SIZE)
+        {
+            return NULL;
+        }
+
+        block = reader->map + reader->offset;
+        reader->offset += BLOCK_SIZE;
+        return block;
+    }
+
+    if (fill_buffer(reader) < BLOCK_SIZE)
+    {
+        return NULL;
+    }
+
+    block = reader->buffer + reader->buffer_start;
+    reader->buffer_start += BLOCK_SIZE;
+    reader->offset += BLOCK_SIZE;
+    return block;
+}
+
+// skips data of a stream that can't seek, reports an error if it ends first
+// data of a pipe is spliced to /dev/null so that it isn't copied to user space,
+// anything else is read into the record buffer and thrown away
+void discard_bytes(struct Reader *reader, long skip)
+{
+    // volumes are switched by reads, they can't be spliced
+    bool spliced = reader->decompressor == NULL && reader->volumes == NULL;
+
+    if (spliced && reader->null_fd < 0)
+    {
+        reader->null_fd = open("/dev/null", O_WRONLY);
+        count_syscalls(1);
+    }
+
+    while (skip > 0 && spliced && reader->null_fd >= 0)
+    {
+        ssize_t moved = splice(reader->fd, NULL, reader->null_fd, NULL, throttled_size(skip), SPLICE_F_MOVE);
+        count_syscalls(1);
+        throttle(moved > 0 ? moved : 0, 1);
+
+        if (moved == 0)
+        {
+            unexpected_eof();
+        }
+        if (moved < 0)
+        {
+            break;
+        }
+        reader->offset += moved;
+        skip -= moved;
+    }
+
+    while (skip > 0)
+    {
+        long count;
+
+        take_bytes(reader, skip, &count);
+
+        if (count == 0)
+        {
+            unexpected_eof();
+        }
+        skip -= count;
+    }
+}
+
+// returns true if reader can move to any offset in the archive
+bool is_seekable(struct Reader *reader)
+{
+    return reader->mapped || (reader->decompressor != NULL && reader->decompressor->frames_count > 0);
+}
+
+// moves reader to offset in the archive, reports an error if it got beyond the end of archive
+// only seekable archives may move backwards
+void seek_reader(struct Reader *reader, long offset)
+{
+    if (reader->mapped)
+    {
+        if (offset > reader->size)
+        {
+            unexpected_eof();
+        }
+        reader->offset = offset;
+        return;
+    }
+
+    struct Decompressor *decompressor = reader->decompressor;
+
+    // frames in between are jumped over instead of being decompressed
+    if (decompressor != NULL && decompressor->frames_count > 0)
+    {
+        long frame = find_frame(decompressor, offset);
+
+        if (offset < reader->offset || frame > find_frame(decompressor, reader->offset))
+        {
+            seek_frame(decompressor, frame);
+            reader->buffer_start = 0;
+            reader->buffer_end = 0;
+            reader->offset = decompressor->frames[frame].offset;
+        }
+    }
+
+    // drop buffered part first, the rest is skipped on the descriptor
+    long skip = offset - reader->offset;
+    long buffered = reader->buffer_end - reader->buffer_start;
+    long dropped = buffered < skip ? buffered : skip;
+
+    reader->buffer_start += dropped;
+    reader->offset += dropped;
+    skip -= dropped;
+
+    // compressed stream has to be decompressed even where it is skipped,
+    // truncated stream is detected by the short read
+    if (decompressor != NULL || reader->size < 0)
+    {
+        discard_bytes(reader, skip);
+        return;
+    }
+
+    if (skip > 0)
+    {
+        lseek(reader->fd, skip, SEEK_CUR);
+        count_syscalls(1);
+        reader->offset += skip;
+    }
+
+    if (reader->offset > reader->size)
+    {
+        unexpected_eof();
+    }
+}
+
+// advances past count blocks, reports an error if it got beyond the end of archive
+void skip_blocks(struct Reader *reader, long count)
+{
+    seek_reader(reader, reader->offset + count * BLOCK_SIZE);
+}
+
+// takes the zero padding of the last block of member data
+void skip_padding(struct Reader *reader, long file_size)
+{
+    long padding = (BLOCK_SIZE - file_size % BLOCK_SIZE) % BLOCK_SIZE;
+    long count;
+
+    while (padding > 0)
+    {
+        take_bytes(reader, padding, &count);
+
+        if (count == 0)
+        {
+            unexpected_eof();
+        }
+        padding -= count;
+    }
+}
+
+// sum of all bytes of a block taken as unsigned numbers
+// it is zero only for a block of zero bytes and it is also the basis of header checksum,
+// so a single pass over the header answers both questions
+unsigned long block_sum(char *block)
+{
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sums = zero;
+
+    // sad against zero adds up each 8 bytes into a 64-bit lane
+    for (int i = 0; i < BLOCK_SIZE; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((__m256i*)(block + i));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(bytes, zero));
+    }
+
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return _mm_cvtsi128_si64(_mm_add_epi64(half, _mm_unpackhi_epi64(half, half)));
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i sums = zero;
+
+    for (int i = 0; i < BLOCK_SIZE; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((__m128i*)(block + i));
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(bytes, zero));
+    }
+
+    return _mm_cvtsi128_si64(_mm_add_epi64(sums, _mm_unpackhi_epi64(sums, sums)));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint32x4_t sums = vdupq_n_u32(0);
+
+    for (int i = 0; i < BLOCK_SIZE; i += 16)
+    {
+        sums = vpadalq_u16(sums, vpaddlq_u8(vld1q_u8((uint8_t*)(block + i))));
+    }
+
+    return vaddvq_u32(sums);
+#else
+    unsigned long sum = 0;
+
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        sum += (unsigned char)block[i];
+    }
+
+    return sum;
+#endif
+}
+
+// compares checksum stored in header with sum of its bytes (as computed by block_sum),
+// checksum is computed as if the checksum field itself was filled with spaces
+bool valid_checksum(struct Header *header, unsigned long sum)
+{
+    long stored = parse_number(header->chksum, sizeof(header->chksum));
+    unsigned long field = 0;
+    long signed_field = 0;
+
+    for (unsigned i = 0; i < sizeof(header->chksum); i++)
+    {
+        field += (unsigned char)header->chksum[i];
+        signed_field += (signed char)header->chksum[i];
+    }
+
+    if ((long)(sum - field + sizeof(header->chksum) * ' ') == stored)
+    {
+        return true;
+    }
+
+    // some old archivers summed bytes as signed chars, the slow path is taken only on mismatch
+    long signed_sum = 0;
+    char *bytes = (char*)header;
+
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        signed_sum += (signed char)bytes[i];
+    }
+
+    return signed_sum - signed_field + (long)sizeof(header->chksum) * ' ' == stored;
+}
+
+// reports damaged header
+void check_header(struct Header *header, unsigned long sum, long header_offset)
+{
+    if (!valid_checksum(header, sum))
+    {
+        char message[64];
+
+        snprintf(message, sizeof(message), "Checksum error in header at block %ld", header_offset / BLOCK_SIZE);
+        fatal(message, "Error is not recoverable: exiting now");
+    }
+}
+
+// POSIX archives store the leading part of long names in prefix field
+bool is_posix_header(struct Header *header)
+{
+    return memcmp(header->magic, POSIX_MAGIC, sizeof(POSIX_MAGIC)) == 0;
+}
+
+// check "magic" field in header
+void is_tar_archive(struct Header *header)
+{
+    // magic is followed by version, together they form MAGIC including its terminating zero
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 && !is_posix_header(header))
+    {
+        fatal("This does not look like a tar archive", "Exiting with failure status due to previous errors");
+    }
+}
+
+// members extracted as regular files, other types have their own handling or are skipped
+bool is_regular_file(struct Header *header)
+{
+    char type = header->typeflag[0];
+
+    return type == REG_FILE[0] || type == OLD_FILE[0] || type == CONTIGUOUS[0];
+}
+
+// extended headers carry no file, they describe the member that follows
+bool is_extended_header(struct Header *header)
+{
+    char type = header->typeflag[0];
+
+    return type == LONG_NAME[0] || type == LONG_LINK[0] || type == PAX_HEADER[0] || type == PAX_GLOBAL[0];
+}
+
+// appends data regions of one block of the sparse map, an empty entry ends the list
+void add_regions(struct SparseMap *map, char (*entries)[24], int count)
+{
+    for (int i = 0; i < count && entries[i][0] != '\0'; i++)
+    {
+        long offset = parse_number(entries[i], 12);
+        long size = parse_number(entries[i] + 12, 12);
+
+        if (offset < 0 || size < 0 || offset > map->real_size - size)
+        {
+            fail("Malformed sparse map");
+        }
+
+        if (map->count == map->capacity)
+        {
+            map->capacity = map->capacity == 0 ? 16 : 2 * map->capacity;
+            map->regions = realloc(map->regions, map->capacity * sizeof(*map->regions));
+
+            if (map->regions == NULL)
+            {
+                fail("Cannot allocate memory");
+            }
+        }
+
+        map->regions[map->count].offset = offset;
+        map->regions[map->count].size = size;
+        map->count++;
+    }
+}
+
+// reads the sparse map of a GNU sparse member, its extension blocks are taken from the reader,
+// so the header must not point into the record buffer, returns the number of extension blocks
+long read_sparse_map(struct Reader *reader, struct Header *header, struct SparseMap *map)
+{
+    struct SparseHeader *sparse = (struct SparseHeader*)header;
+    bool extended = sparse->isextended[0] != '\0';
+    long blocks = 0;
+    long stored = 0;
+
+    map->count = 0;
+    map->real_size = parse_number(sparse->realsize, sizeof(sparse->realsize));
+
+    if (map->real_size < 0)
+    {
+        fail("Malformed sparse map");
+    }
+
+    add_regions(map, sparse->sparse, HEADER_REGIONS);
+
+    while (extended)
+    {
+        struct SparseExtension *extension = (struct SparseExtension*)read_block(reader);
+
+        if (extension == NULL)
+        {
+            unexpected_eof();
+        }
+        add_regions(map, extension->sparse, EXTENSION_REGIONS);
+        extended = extension->isextended[0] != '\0';
+        blocks++;
+    }
+
+    // data of all regions is stored one after another as the member's data
+    for (long i = 0; i < map->count; i++)
+    {
+        stored += map->regions[i].size;
+    }
+
+    if (stored != member_size(header))
+    {
+        fail("Malformed sparse map");
+    }
+    return blocks;
+}
+
+// forgets attributes of the previous member
+void reset_extended(struct Extended *extended)
+{
+    extended->has_name = false;
+    extended->has_link = false;
+    extended->size = -1;
+    extended->has_mtime = false;
+    extended->uid = -1;
+    extended->gid = -1;
+    extended->offset = -1;
+}
+
+// copies a name which is not terminated, names not fitting PATH_MAX can't be created anyway
+void set_name(char *target, char *value, long length)
+{
+    if (length >= PATH_MAX)
+    {
+        fail("File name is too long");
+    }
+    memcpy(target, value, length);
+    target[length] = '\0';
+}
+
+// returns data of an extended header, data of a mapped archive are used in place,
+// a stream is copied into the buffer shared by all extended headers
+char *read_extended_data(struct Reader *reader, struct Extended *extended, long size)
+{
+    long blocks_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long copied = 0;
+    long count;
+
+    if (reader->mapped)
+    {
+        char *data = reader->map + reader->offset;
+
+        skip_blocks(reader, blocks_count);              // check that data is present in the archive
+        return data;
+    }
+
+    if (size > extended->capacity)
+    {
+        extended->data = realloc(extended->data, size);
+        extended->capacity = size;
+
+        if (extended->data == NULL)
+        {
+            fail("Cannot allocate memory");
+        }
+    }
+
+    while (copied < size)
+    {
+        char *data = take_bytes(reader, size - copied, &count);
+
+        if (count == 0)
+        {
+            unexpected_eof();
+        }
+        memcpy(extended->data + copied, data, count);
+        copied += count;
+    }
+
+    skip_padding(reader, size);
+    return extended->data;
+}
+
+// parses a decimal pax value, returns false unless it is digits only and fits
+bool parse_decimal(char *value, long length, long *result)
+{
+    long number = 0;
+
+    for (long i = 0; i < length; i++)
+    {
+        if (value[i] < '0' || value[i] > '9' || number > (LONG_MAX - 9) / 10)
+        {
+            return false;
+        }
+        number = number * 10 + (value[i] - '0');
+    }
+
+    *result = number;
+    return length > 0;
+}
+
+// parses pax time "[-]seconds[.fraction]", fraction beyond nanoseconds is dropped
+bool parse_pax_time(char *value, long length, long *seconds, long *nanoseconds)
+{
+    bool negative = length > 0 && value[0] == '-';
+    char *dot = memchr(value, '.', length);
+    long whole = dot != NULL ? dot - value : length;
+    long fraction = 0;
+
+    if (!parse_decimal(value + negative, whole - negative, seconds))
+    {
+        return false;
+    }
+
+    for (long i = whole + 1, scale = 100000000; i < length; i++, scale /= 10)
+    {
+        if (value[i] < '0' || value[i] > '9')
+        {
+            return false;
+        }
+        fraction += (value[i] - '0') * scale;
+    }
+
+    // -1.5 is 1.5 seconds before the epoch, which is second -2 and a half
+    if (negative)
+    {
+        *seconds = fraction > 0 ? -*seconds - 1 : -*seconds;
+        fraction = fraction > 0 ? 1000000000 - fraction : 0;
+    }
+    *nanoseconds = fraction;
+    return true;
+}
+
+bool is_keyword(char *keyword, long length, char *expected)
+{
+    return length == (long)strlen(expected) && memcmp(keyword, expected, length) == 0;
+}
+
+// takes path, linkpath, size, mtime, uid and gid from pax records "<length> <keyword>=<value>\n" of a member,
+// other keywords are of no use to extraction and are skipped, returns false if records are malformed
+bool parse_pax(struct Extended *extended, char *data, long size)
+{
+    long position = 0;
+
+    while (position < size)
+    {
+        char *record = data + position;
+        long left = size - position;
+        long length = 0;
+        long digits = 0;
+
+        while (digits < left && record[digits] >= '0' && record[digits] <= '9' && length <= left)
+        {
+            length = length * 10 + (record[digits++] - '0');
+        }
+
+        if (digits == 0 || digits >= left || record[digits] != ' ' || length <= digits + 1 || length > left || record[length - 1] != '\n')
+        {
+            return false;
+        }
+
+        char *keyword = record + digits + 1;
+        char *end = record + length - 1;
+        char *equals = memchr(keyword, '=', end - keyword);
+
+        if (equals == NULL)
+        {
+            return false;
+        }
+
+        long keyword_length = equals - keyword;
+        char *value = equals + 1;
+        long value_length = end - value;
+
+        if (is_keyword(keyword, keyword_length, "path"))
+        {
+            set_name(extended->name, value, value_length);
+            extended->has_name = true;
+        }
+        else if (is_keyword(keyword, keyword_length, "linkpath"))
+        {
+            set_name(extended->link, value, value_length);
+            extended->has_link = true;
+        }
+        else if (is_keyword(keyword, keyword_length, "size"))
+        {
+            if (!parse_decimal(value, value_length, &extended->size))
+            {
+                return false;
+            }
+        }
+        else if (is_keyword(keyword, keyword_length, "mtime"))
+        {
+            if (!parse_pax_time(value, value_length, &extended->mtime, &extended->mtime_nsec))
+            {
+                return false;
+            }
+            extended->has_mtime = true;
+        }
+        else if (is_keyword(keyword, keyword_length, "uid"))
+        {
+            if (!parse_decimal(value, value_length, &extended->uid))
+            {
+                return false;
+            }
+        }
+        else if (is_keyword(keyword, keyword_length, "gid"))
+        {
+            if (!parse_decimal(value, value_length, &extended->gid))
+            {
+                return false;
+            }
+        }
+
+        position += length;
+    }
+
+    return true;
+}
+
+// reads a GNU long name, a GNU long link target or pax records of the next member,
+// global pax records would apply to all members, but none that matter to extraction may be global
+void read_extended_header(struct Reader *reader, struct Header *header, struct Extended *extended, long header_offset)
+{
+    long size = member_size(header);
+    char type = header->typeflag[0];
+    char *data = read_extended_data(reader, extended, size);
+
+    if (extended->offset < 0)
+    {
+        extended->offset = header_offset;
+    }
+
+    if (type == LONG_NAME[0])
+    {
+        set_name(extended->name, data, strnlen(data, size));
+        extended->has_name = true;
+    }
+    else if (type == LONG_LINK[0])
+    {
+        set_name(extended->link, data, strnlen(data, size));
+        extended->has_link = true;
+    }
+    else if (type == PAX_HEADER[0])
+    {
+        if (!parse_pax(extended, data, size))
+        {
+            fail("Malformed pax header");
+        }
+    }
+}
+
+// name of the member, extended headers take precedence over name field, which is joined
+// with prefix in POSIX archives, fields are not terminated when they are full
+char *entry_name(struct Header *header, struct Extended *extended, char *buffer)
+{
+    long length = strnlen(header->name, sizeof(header->name));
+
+    if (extended->has_name)
+    {
+        return extended->name;
+    }
+
+    if (is_posix_header(header) && header->prefix[0] != '\0')
+    {
+        long prefix_length = strnlen(header->prefix, sizeof(header->prefix));
+
+        memcpy(buffer, header->prefix, prefix_length);
+        buffer[prefix_length] = '/';
+        memcpy(buffer + prefix_length + 1, header->name, length);
+        buffer[prefix_length + 1 + length] = '\0';
+        return buffer;
+    }
+
+    if (length < (long)sizeof(header->name))
+    {
+        return header->name;
+    }
+
+    set_name(buffer, header->name, length);
+    return buffer;
+}
+
+// modification time of the member in whole seconds, pax records take precedence over the header
+long entry_mtime(struct Header *header, struct Extended *extended)
+{
+    return extended->has_mtime ? extended->mtime : parse_number(header->mtime, sizeof(header->mtime));
+}
+
+// target of a symbolic or hard link
+char *entry_link(struct Header *header, struct Extended *extended, char *buffer)
+{
+    long length = strnlen(header->linkname, sizeof(header->linkname));
+
+    if (extended->has_link)
+    {
+        return extended->link;
+    }
+
+    if (length < (long)sizeof(header->linkname))
+    {
+        return header->linkname;
+    }
+
+    set_name(buffer, header->linkname, length);
+    return buffer;
+}
+
+// FNV-1a hash of a member name
+unsigned long hash_name(char *name)
+{
+    unsigned long hash = 14695981039346656037UL;
+
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211UL;
+    }
+    return hash;
+}
+
+uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// words of XXH64 input are little-endian
+uint64_t read_word(unsigned char *p, int size)
+{
+    uint64_t word = 0;
+
+    memcpy(&word, p, size);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word) >> (64 - 8 * size);
+#endif
+    return word;
+}
+
+uint64_t xxh_round(uint64_t lane, uint64_t input)
+{
+    return rotate_left(lane + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+void init_hasher(struct Hasher *hasher)
+{
+    hasher->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    hasher->lanes[1] = XXH_PRIME2;
+    hasher->lanes[2] = 0;
+    hasher->lanes[3] = -XXH_PRIME1;
+    hasher->pending_size = 0;
+    hasher->total = 0;
+}
+
+void hash_stripe(struct Hasher *hasher, unsigned char *stripe)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        hasher->lanes[i] = xxh_round(hasher->lanes[i], read_word(stripe + 8 * i, 8));
+    }
+}
+
+void update_hasher(struct Hasher *hasher, char *data, long size)
+{
+    unsigned char *p = (unsigned char*)data;
+    unsigned char *end = p + size;
+
+    hasher->total += size;
+
+    if (hasher->pending_size > 0)
+    {
+        long fill = XXH_STRIPE - hasher->pending_size < size ? XXH_STRIPE - hasher->pending_size : size;
+
+        memcpy(hasher->pending + hasher->pending_size, p, fill);
+        hasher->pending_size += fill;
+        p += fill;
+
+        if (hasher->pending_size < XXH_STRIPE)
+        {
+            return;
+        }
+        hash_stripe(hasher, hasher->pending);
+        hasher->pending_size = 0;
+    }
+
+    for (; end - p >= XXH_STRIPE; p += XXH_STRIPE)
+    {
+        hash_stripe(hasher, p);
+    }
+
+    memcpy(hasher->pending, p, end - p);
+    hasher->pending_size = end - p;
+}
+
+uint64_t finish_hasher(struct Hasher *hasher)
+{
+    uint64_t *lanes = hasher->lanes;
+    uint64_t hash = lanes[2] + XXH_PRIME5;
+    unsigned char *p = hasher->pending;
+    int left = hasher->pending_size;
+
+    if (hasher->total >= XXH_STRIPE)
+    {
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) + rotate_left(lanes[3], 18);
+
+        for (int i = 0; i < 4; i++)
+        {
+            hash = (hash ^ xxh_round(0, lanes[i])) * XXH_PRIME1 + XXH_PRIME4;
+        }
+    }
+
+    hash += hasher->total;
+
+    for (; left >= 8; p += 8, left -= 8)
+    {
+        hash = rotate_left(hash ^ xxh_round(0, read_word(p, 8)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (left >= 4)
+    {
+        hash = rotate_left(hash ^ read_word(p, 4) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+    {
+        hash = rotate_left(hash ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// hashes data of a member while passing over it, in place of skipping it
+uint64_t hash_data(struct Reader *reader, long file_size)
+{
+    struct Hasher hasher;
+    long started = stats_clock();
+
+    init_hasher(&hasher);
+
+    if (reader->mapped)
+    {
+        long data_offset = reader->offset;
+
+        skip_blocks(reader, (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);    // check that data is present
+        update_hasher(&hasher, reader->map + data_offset, file_size);
+    }
+    else
+    {
+        for (long left = file_size; left > 0; )
+        {
+            long count;
+            char *data = take_bytes(reader, left, &count);
+
+            if (count == 0)
+            {
+                unexpected_eof();
+            }
+            update_hasher(&hasher, data, count);
+            left -= count;
+        }
+        skip_padding(reader, file_size);
+    }
+
+    add_stat(&stats.hashed, file_size);
+    add_time(&stats.hash_time, started);
+    return finish_hasher(&hasher);
+}
+
+// parses [...] starting at pattern, returns length of the class or 0 if it is not closed
+long compile_class(char *pattern, struct Token *token)
+{
+    long i = 1;
+    bool negated = pattern[i] == '!' || pattern[i] == '^';
+
+    memset(token->class, 0, sizeof(token->class));
+    token->type = CHAR_CLASS;
+    i += negated;
+
+    // closing bracket right after the opening one is a member of the class
+    for (bool first = true; pattern[i] != '\0' && (first || pattern[i] != ']'); first = false)
+    {
+        unsigned char low = pattern[i];
+        unsigned char high = low;
+
+        if (pattern[i + 1] == '-' && pattern[i + 2] != ']' && pattern[i + 2] != '\0')
+        {
+            high = pattern[i + 2];
+            i += 2;
+        }
+        i++;
+
+        for (unsigned c = low; c <= high; c++)
+        {
+            token->class[c / 64] |= 1UL << (c % 64);
+        }
+    }
+
+    if (pattern[i] != ']')
+    {
+        return 0;
+    }
+
+    for (int k = 0; negated && k < 4; k++)
+    {
+        token->class[k] = ~token->class[k];
+    }
+    return i + 1;
+}
+
+struct Token *add_token(struct FileSet *set, enum token_type type)
+{
+    struct Token *token;
+
+    if (set->tokens_count == set->tokens_capacity)
+    {
+        set->tokens_capacity = set->tokens_capacity == 0 ? 64 : 2 * set->tokens_capacity;
+        set->tokens = realloc(set->tokens, set->tokens_capacity * sizeof(struct Token));
+
+        if (set->tokens == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+
+    token = &set->tokens[set->tokens_count++];
+    memset(token, 0, sizeof(*token));
+    token->type = type;
+    return token;
+}
+
+// turns an argument into tokens, trailing slashes are dropped as it matches anything below it anyway,
+// *, ?, [...] and backslash escapes have their shell meaning with wildcards and no meaning without them
+void compile_pattern(struct FileSet *set, char *pattern, int index, bool wildcards)
+{
+    long length = strlen(pattern);
+
+    while (length > 1 && pattern[length - 1] == '/')
+    {
+        length--;
+    }
+
+    for (long i = 0; i < length; )
+    {
+        struct Token class;
+        long class_length;
+
+        if (wildcards && pattern[i] == '*')
+        {
+            // previous pattern ends with FINAL, so only a star of this one is merged
+            if (set->tokens_count == 0 || set->tokens[set->tokens_count - 1].type != ANY_STRING)
+            {
+                add_token(set, ANY_STRING);
+            }
+            i++;
+        }
+        else if (wildcards && pattern[i] == '?')
+        {
+            add_token(set, ANY_CHAR);
+            i++;
+        }
+        else if (wildcards && pattern[i] == '[' && (class_length = compile_class(pattern + i, &class)) > 0)
+        {
+            *add_token(set, CHAR_CLASS) = class;
+            i += class_length;
+        }
+        else
+        {
+            if (wildcards && pattern[i] == '\\' && i + 1 < length)
+            {
+                i++;
+            }
+            add_token(set, LITERAL)->c = pattern[i++];
+        }
+    }
+
+    add_token(set, FINAL)->pattern = index;
+}
+
+// adds token and everything reachable from it without reading a byte
+void add_closure(struct FileSet *set, uint32_t token)
+{
+    while (set->seen[token] != set->generation)
+    {
+        set->seen[token] = set->generation;
+        set->scratch[set->scratch_length++] = token;
+
+        if (set->tokens[token].type != ANY_STRING)
+        {
+            break;
+        }
+        token++;
+    }
+}
+
+int compare_tokens(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+unsigned long hash_set(uint32_t *set, long length)
+{
+    unsigned long hash = 14695981039346656037UL;
+
+    for (long i = 0; i < length; i++)
+    {
+        hash = (hash ^ set[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// returns the state of the set in scratch, making a new one if there is none yet
+uint32_t intern_state(struct FileSet *set)
+{
+    uint32_t *tokens = set->scratch;
+    long length = set->scratch_length;
+
+    qsort(tokens, length, sizeof(uint32_t), compare_tokens);
+
+    unsigned long slot = hash_set(tokens, length) & set->state_mask;
+
+    for (; set->state_slots[slot] != 0; slot = (slot + 1) & set->state_mask)
+    {
+        struct MatchState *state = &set->states[set->state_slots[slot] - 1];
+
+        if (state->length == length && memcmp(set->pool + state->set, tokens, length * sizeof(uint32_t)) == 0)
+        {
+            return set->state_slots[slot] - 1;
+        }
+    }
+
+    if (set->states_count == set->states_capacity || set->pool_length + length > set->pool_capacity)
+    {
+        set->states_capacity *= 2;
+        set->pool_capacity = 2 * (set->pool_capacity + length);
+        set->states = realloc(set->states, set->states_capacity * sizeof(struct MatchState));
+        set->pool = realloc(set->pool, set->pool_capacity * sizeof(uint32_t));
+
+        if (set->states == NULL || set->pool == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+
+    struct MatchState *state = &set->states[set->states_count];
+
+    memcpy(set->pool + set->pool_length, tokens, length * sizeof(uint32_t));
+    state->set = set->pool_length;
+    state->length = length;
+    state->accepting = false;
+    state->marked = false;
+    set->pool_length += length;
+
+    for (long i = 0; i < length; i++)
+    {
+        state->accepting |= set->tokens[tokens[i]].type == FINAL;
+    }
+
+    set->state_slots[slot] = ++set->states_count;
+    return set->states_count - 1;
+}
+
+// forgets all states but the initial one, both hash tables are sized for states_limit
+// so that neither has to grow, they come zeroed from calloc the first time
+void reset_states(struct FileSet *set)
+{
+    if (set->states_count > 0)
+    {
+        memset(set->state_slots, 0, (set->state_mask + 1) * sizeof(uint32_t));
+        memset(set->transition_keys, 0, (set->transition_mask + 1) * sizeof(uint64_t));
+    }
+    set->states_count = 0;
+    set->pool_length = 0;
+    set->transitions_count = 0;
+
+    // every pattern may start matching at the beginning of the name
+    set->generation++;
+    set->scratch_length = 0;
+
+    for (long i = 0; i < set->tokens_count; i++)
+    {
+        if (i == 0 || set->tokens[i - 1].type == FINAL)
+        {
+            add_closure(set, i);
+        }
+    }
+    intern_state(set);
+}
+
+// compiles names into the matching automaton, takes ownership of names array
+void init_file_set(struct FileSet *set, char **names, int count, bool wildcards)
+{
+    memset(set, 0, sizeof(*set));
+    set->names = names;
+    set->count = count;
+    set->missing = count;
+    set->wildcards = wildcards;
+    set->found = calloc(count > 0 ? count : 1, sizeof(bool));
+
+    if (set->found == NULL)
+    {
+        errx(2, "calloc");
+    }
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        compile_pattern(set, names[i], i, wildcards);
+    }
+
+    // tables get their share of --max-memory, a name still fits in them many times over
+    set->states_limit = MATCH_STATES_LIMIT;
+
+    while (limits.memory > 0 && set->states_limit > 4 * PATH_MAX
+           && set->states_limit * 2 * (long)(2 * sizeof(uint32_t) + sizeof(uint64_t)) > limits.memory / MEMORY_SHARE)
+    {
+        set->states_limit /= 2;
+    }
+
+    set->state_mask = 2 * set->states_limit - 1;
+    set->transition_mask = 2 * set->states_limit - 1;
+    set->states_capacity = 64;
+    set->pool_capacity = 64 + set->tokens_count;
+    set->state_slots = calloc(set->state_mask + 1, sizeof(uint32_t));
+    set->transition_keys = calloc(set->transition_mask + 1, sizeof(uint64_t));
+    set->transition_targets = malloc((set->transition_mask + 1) * sizeof(uint32_t));
+    set->states = malloc(set->states_capacity * sizeof(struct MatchState));
+    set->pool = malloc(set->pool_capacity * sizeof(uint32_t));
+    set->scratch = malloc(set->tokens_count * sizeof(uint32_t));
+    set->seen = calloc(set->tokens_count, sizeof(uint32_t));
+
+    if (set->state_slots == NULL || set->transition_keys == NULL || set->transition_targets == NULL
+        || set->states == NULL || set->pool == NULL || set->scratch == NULL || set->seen == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    reset_states(set);
+}
+
+void free_file_set(struct FileSet *set)
+{
+    free(set->names);
+    free(set->found);
+    free(set->tokens);
+    free(set->pool);
+    free(set->states);
+    free(set->state_slots);
+    free(set->transition_keys);
+    free(set->transition_targets);
+    free(set->scratch);
+    free(set->seen);
+}
+
+// state reached from state by reading byte c, transitions are computed once and remembered
+uint32_t next_state(struct FileSet *set, uint32_t state, unsigned char c)
+{
+    uint64_t key = ((uint64_t)state << 8 | c) + 1;
+    unsigned long slot = (key * 11400714819323198485UL >> 20) & set->transition_mask;
+
+    for (; set->transition_keys[slot] != 0; slot = (slot + 1) & set->transition_mask)
+    {
+        if (set->transition_keys[slot] == key)
+        {
+            return set->transition_targets[slot];
+        }
+    }
+
+    set->generation++;
+    set->scratch_length = 0;
+
+    struct MatchState *from = &set->states[state];
+
+    for (uint32_t i = 0; i < from->length; i++)
+    {
+        uint32_t token = set->pool[from->set + i];
+        struct Token *t = &set->tokens[token];
+
+        if (t->type == ANY_STRING)
+        {
+            add_closure(set, token);
+        }
+        else if (t->type == ANY_CHAR || (t->type == LITERAL && t->c == c)
+                 || (t->type == CHAR_CLASS && (t->class[c / 64] >> (c % 64) & 1)))
+        {
+            add_closure(set, token + 1);
+        }
+    }
+
+    uint32_t next = intern_state(set);
+
+    set->transition_keys[slot] = key;
+    set->transition_targets[slot] = next;
+    set->transitions_count++;
+    return next;
+}
+
+// marks arguments matched in state as found
+void mark_state(struct FileSet *set, uint32_t state)
+{
+    struct MatchState *s = &set->states[state];
+
+    for (uint32_t i = 0; i < s->length; i++)
+    {
+        struct Token *token = &set->tokens[set->pool[s->set + i]];
+
+        if (token->type == FINAL && !set->found[token->pattern])
+        {
+            set->found[token->pattern] = true;
+            set->missing--;
+        }
+    }
+    s->marked = true;
+}
+
+// returns true if an argument matches the whole name or its leading directories, so that
+// a directory selects everything below it, when mark is set, matching arguments are found
+bool match_name(struct FileSet *set, char *filename, bool mark)
+{
+    bool matched = false;
+
+    set->below = false;
+
+    if (set->count == 0)
+    {
+        return false;
+    }
+
+    // tables are not to get more than half full, a name adds at most one state per byte
+    if (set->states_count >= set->states_limit - PATH_MAX || set->transitions_count >= set->states_limit - PATH_MAX)
+    {
+        reset_states(set);
+    }
+
+    uint32_t state = 0;
+
+    for (unsigned char *c = (unsigned char*)filename; ; c++)
+    {
+        if (set->states[state].accepting && (*c == '/' || *c == '\0'))
+        {
+            matched = true;
+            set->below |= *c == '/';
+            set->directory_matched |= *c == '/';
+
+            if (mark && !set->states[state].marked)
+            {
+                mark_state(set, state);
+            }
+        }
+
+        if (*c == '\0' || set->states[state].length == 0)
+        {
+            break;
+        }
+        state = next_state(set, state, *c);
+    }
+    return matched;
+}
+
+// if filename is selected by arguments, mark them as found and return true
+// (so that filename will be printed)
+bool mark_file(struct FileSet *set, char *filename)
+{
+    return match_name(set, filename, true);
+}
+
+// reports files that were not found in the archive
+// returns true if any of specified files was NOT present in archive
+bool report_missing_files(struct FileSet *set)
+{
+    if (set->missing == 0)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < set->count; i++)
+    {
+        if (!set->found[i])
+        {
+            warnx("%s: Not found in archive", set->names[i]);
+        }
+    }
+    return true;
+}
+
+// writes whole buffer to fd, retrying on partial writes
+void write_all(int fd, char *data, long size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, data, throttled_size(size));
+        count_syscalls(1);
+        throttle(written > 0 ? written : 0, 1);
+
+        if (written < 0)
+        {
+            errx(2, "Error writing file");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+// copies member data from mapped archive to fd inside the kernel,
+// falls back to writing from the mapping if the filesystem can't do that
+void copy_mapped_data(struct Reader *reader, int fd, long data_offset, long file_size)
+{
+    loff_t in_offset = data_offset;
+    long left = file_size;
+
+    while (left > 0)
+    {
+        ssize_t copied = copy_file_range(reader->fd, &in_offset, fd, NULL, throttled_size(left), 0);
+        count_syscalls(1);
+        throttle(copied > 0 ? 2 * copied : 0, 1);       // read from the archive and written to the file
+
+        if (copied <= 0)
+        {
+            break;
+        }
+        left -= copied;
+    }
+
+    write_all(fd, reader->map + in_offset, left);
+}
+
+// writes member data buffered in the record buffer, then moves the rest from a pipe
+// to fd with splice, anything splice can't move (archive is not a pipe) is read
+// through the record buffer
+void copy_stream_bytes(struct Reader *reader, int fd, long size)
+{
+    long left = size;
+    long count;
+    char *data;
+
+    if (reader->buffer_end > reader->buffer_start)
+    {
+        data = take_bytes(reader, left, &count);
+        write_all(fd, data, count);
+        left -= count;
+    }
+
+    while (left > 0 && reader->decompressor == NULL && reader->volumes == NULL)
+    {
+        ssize_t moved = splice(reader->fd, NULL, fd, NULL, throttled_size(left), SPLICE_F_MOVE);
+        count_syscalls(1);
+        throttle(moved > 0 ? 2 * moved : 0, 1);
+
+        if (moved == 0)
+        {
+            unexpected_eof();
+        }
+        if (moved < 0)
+        {
+            break;
+        }
+        reader->offset += moved;
+        left -= moved;
+    }
+
+    while (left > 0)
+    {
+        data = take_bytes(reader, left, &count);
+
+        if (count == 0)
+        {
+            unexpected_eof();
+        }
+        write_all(fd, data, count);
+        left -= count;
+    }
+}
+
+void copy_stream_data(struct Reader *reader, int fd, long file_size)
+{
+    copy_stream_bytes(reader, fd, file_size);
+    skip_padding(reader, file_size);
+}
+
+// reserves blocks of a large file up front, so that the file system doesn't allocate them
+// piece by piece as data arrive, it is only a hint and failure doesn't matter
+void preallocate(int fd, long offset, long size)
+{
+    if (size >= PREALLOCATE_MIN)
+    {
+        (void)fallocate(fd, 0, offset, size);
+        count_syscalls(1);
+    }
+}
+
+struct Directory *new_directory(int fd, char *path, long length)
+{
+    struct Directory *directory = malloc(sizeof(struct Directory) + length + 1);
+
+    if (directory == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    directory->fd = fd;
+    directory->references = 1;
+    directory->used = 0;
+    memcpy(directory->path, path, length);
+    directory->path[length] = '\0';
+    return directory;
+}
+
+// taken by the thread that queues a file for creation in the directory
+void retain_directory(struct Directory *directory)
+{
+    __atomic_add_fetch(&directory->references, 1, __ATOMIC_RELAXED);
+}
+
+// last reference closes the directory, writer threads release theirs as soon as the file is open
+void release_directory(struct Directory *directory)
+{
+    if (__atomic_sub_fetch(&directory->references, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(directory->fd);
+        free(directory);
+    }
+}
+
+void open_directory_cache(struct DirectoryCache *cache, char *root, bool creating)
+{
+    int fd = open(root != NULL ? root : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        errx(2, "%s: Cannot open directory", root != NULL ? root : ".");
+    }
+
+    cache->root = new_directory(fd, "", 0);
+    cache->creating = creating;
+    cache->count = 0;
+    cache->last = 0;
+    cache->clock = 0;
+    cache->deferred = NULL;
+    cache->deferred_count = 0;
+    cache->deferred_capacity = 0;
+}
+
+void close_directory_cache(struct DirectoryCache *cache)
+{
+    for (int i = 0; i < cache->count; i++)
+    {
+        release_directory(cache->entries[i]);
+    }
+    release_directory(cache->root);
+
+    for (long i = 0; i < cache->deferred_count; i++)
+    {
+        free(cache->deferred[i].name);
+    }
+    free(cache->deferred);
+}
+
+// member name is path without leading slashes, which would make extraction
+// write outside of the current directory
+char *member_name(char *path)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    return path;
+}
+
+// name a member is extracted or compared under, it is the member name, so absolute names
+// stay in the directory, NULL if a ".." component would take it out of there
+char *beneath_name(char *name)
+{
+    char *path = member_name(name);
+
+    for (char *part = path; part != NULL; part = strchr(part, '/'))
+    {
+        part += *part == '/';
+
+        if (part[0] == '.' && part[1] == '.' && (part[2] == '/' || part[2] == '\0'))
+        {
+            return NULL;
+        }
+    }
+    return path;
+}
+
+// opens directory at path relative to root, creating it and its missing parents if asked to,
+// symbolic links on the way are not followed, an archive could extract one and then write through it
+int open_parent(int root, char *path, bool creating)
+{
+    struct open_how how = {
+        .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS
+    };
+    int fd = syscall(SYS_openat2, root, path, &how, sizeof(how));
+
+    count_syscalls(1);
+
+    if (fd >= 0 || (errno != ENOSYS && (errno != ENOENT || !creating)))
+    {
+        return fd;
+    }
+
+    // without openat2 or when a parent is missing, path is walked a component at a time,
+    // parents of the first member in a directory are made here, the rest find it in the cache
+    fd = root;
+
+    for (char *part = path, *slash; ; part = slash + 1)
+    {
+        slash = strchr(part, '/');
+
+        if (slash != NULL)
+        {
+            *slash = '\0';
+        }
+
+        // failure shows when the directory is opened
+        if (creating)
+        {
+            (void)mkdirat(fd, *part != '\0' ? part : ".", 0777);
+        }
+
+        int next = openat(fd, *part != '\0' ? part : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        count_syscalls(creating ? 2 : 1);
+
+        if (fd != root)
+        {
+            close(fd);
+        }
+        if (slash != NULL)
+        {
+            *slash = '/';
+        }
+
+        fd = next;
+
+        if (fd < 0 || slash == NULL)
+        {
+            return fd;
+        }
+    }
+}
+
+// directory that member of given name is created in, name + *leaf is its last component,
+// members come mostly in the order of directories, so the previous one is tried first,
+// NULL if the directory is missing and the cache doesn't create directories
+struct Directory *parent_directory(struct DirectoryCache *cache, char *name, long *leaf)
+{
+    long length = strlen(name);
+
+    // name of a directory member ends with a slash
+    while (length > 1 && name[length - 1] == '/')
+    {
+        length--;
+    }
+
+    long slash = length - 1;
+
+    while (slash >= 0 && name[slash] != '/')
+    {
+        slash--;
+    }
+
+    *leaf = slash + 1;
+
+    if (slash < 0)
+    {
+        return cache->root;
+    }
+
+    long parent_length = slash;
+    int found = -1;
+
+    for (int i = 0; i < cache->count && found < 0; i++)
+    {
+        int candidate = (cache->last + i) % cache->count;
+        char *path = cache->entries[candidate]->path;
+
+        if (strncmp(path, name, parent_length) == 0 && path[parent_length] == '\0')
+        {
+            found = candidate;
+        }
+    }
+
+    if (found < 0)
+    {
+        char path[PATH_MAX];
+        long started = stats_clock();
+
+        memcpy(path, name, parent_length);
+        path[parent_length] = '\0';
+
+        int fd = open_parent(cache->root->fd, path, cache->creating);
+
+        add_time(&stats.create_time, started);
+
+        if (fd < 0 && !cache->creating)
+        {
+            return NULL;
+        }
+
+        if (fd < 0)
+        {
+            errx(2, "%s: Cannot open directory", path);
+        }
+
+        found = cache->count;
+
+        if (cache->count < DIRECTORY_CACHE_SIZE)
+        {
+            cache->count++;
+        }
+        else
+        {
+            found = 0;
+
+            for (int i = 1; i < cache->count; i++)
+            {
+                if (cache->entries[i]->used < cache->entries[found]->used)
+                {
+                    found = i;
+                }
+            }
+            release_directory(cache->entries[found]);
+        }
+
+        cache->entries[found] = new_directory(fd, name, parent_length);
+    }
+
+    cache->entries[found]->used = ++cache->clock;
+    cache->last = found;
+    return cache->entries[found];
+}
+
+// attributes of the member described by header and its pax records, as they are restored for the current user
+void read_metadata(struct Header *header, struct Extended *extended, struct Metadata *metadata, bool owner,
+                   mode_t mask)
+{
+    metadata->mode = parse_number(header->mode, sizeof(header->mode)) & 07777 & ~mask;
+    metadata->uid = extended->uid >= 0 ? extended->uid : parse_number(header->uid, sizeof(header->uid));
+    metadata->gid = extended->gid >= 0 ? extended->gid : parse_number(header->gid, sizeof(header->gid));
+    metadata->owner = owner;
+    metadata->mtime = entry_mtime(header, extended);
+    metadata->mtime_nsec = extended->has_mtime ? extended->mtime_nsec : 0;
+}
+
+// restores attributes of an extracted file through its descriptor, once its data is written,
+// ownership goes first, as changing it clears set-user-ID and set-group-ID bits
+void restore_metadata(int fd, char *name, struct Metadata *metadata)
+{
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { metadata->mtime, metadata->mtime_nsec } };
+
+    if (metadata->owner && fchown(fd, metadata->uid, metadata->gid) < 0)
+    {
+        warnx("%s: Cannot change ownership", name);
+    }
+
+    if (fchmod(fd, metadata->mode) < 0)
+    {
+        warnx("%s: Cannot change mode", name);
+    }
+
+    if (futimens(fd, times) < 0)
+    {
+        warnx("%s: Cannot change modification time", name);
+    }
+    count_syscalls(metadata->owner ? 3 : 2);
+}
+
+// the same for a file that is not open, a symbolic link keeps its own mode
+void restore_metadata_at(int directory, char *name, struct Metadata *metadata, bool symbolic)
+{
+    struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { metadata->mtime, metadata->mtime_nsec } };
+
+    if (metadata->owner && fchownat(directory, name, metadata->uid, metadata->gid, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+        warnx("%s: Cannot change ownership", name);
+    }
+
+    if (!symbolic && fchmodat(directory, name, metadata->mode, 0) < 0)
+    {
+        warnx("%s: Cannot change mode", name);
+    }
+
+    if (utimensat(directory, name, times, AT_SYMLINK_NOFOLLOW) < 0)
+    {
+        warnx("%s: Cannot change modification time", name);
+    }
+    count_syscalls((metadata->owner ? 2 : 1) + !symbolic);
+}
+
+void defer_directory(struct DirectoryCache *cache, char *name, struct Metadata *metadata)
+{
+    if (cache->deferred_count == cache->deferred_capacity)
+    {
+        cache->deferred_capacity = cache->deferred_capacity == 0 ? 256 : cache->deferred_capacity * 2;
+        cache->deferred = realloc(cache->deferred, sizeof(struct DeferredDirectory) * cache->deferred_capacity);
+
+        if (cache->deferred == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+
+    struct DeferredDirectory *deferred = &cache->deferred[cache->deferred_count++];
+
+    deferred->name = strdup(name);
+    deferred->metadata = *metadata;
+
+    if (deferred->name == NULL)
+    {
+        errx(2, "strdup");
+    }
+}
+
+// one pass over extracted directories after everything else is written, in reverse order,
+// so that a directory is done before its parent, which may be made unsearchable,
+// each is opened without following links, a later member may have replaced it with one
+void restore_directories(struct DirectoryCache *cache)
+{
+    long started = stats_clock();
+
+    for (long i = cache->deferred_count - 1; i >= 0; i--)
+    {
+        char *name = cache->deferred[i].name;
+        long leaf;
+        struct Directory *parent = parent_directory(cache, name, &leaf);
+        char last[NAME_MAX + 1];
+
+        // trailing slash would follow the link
+        snprintf(last, sizeof(last), "%.*s", (int)strcspn(name + leaf, "/"), name + leaf);
+
+        int fd = openat(parent->fd, *last != '\0' ? last : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        count_syscalls(2);
+
+        if (fd < 0)
+        {
+            warnx("%s: Cannot restore attributes", name);
+            continue;
+        }
+        restore_metadata(fd, name, &cache->deferred[i].metadata);
+        close(fd);
+    }
+    add_time(&stats.create_time, started);
+}
+
+// every file opened by it is closed by close_file
+int create_file(int directory, char *name)
+{
+    acquire_file();
+
+    long started = stats_clock();
+    int fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666);
+
+    count_syscalls(1);
+
+    // symbolic link in the way is replaced, not written through
+    if (fd < 0 && errno == ELOOP)
+    {
+        unlinkat(directory, name, 0);
+        fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666);
+        count_syscalls(2);
+    }
+    throttle(0, 1);
+    add_time(&stats.create_time, started);
+
+    if (fd < 0)
+    {
+        errx(2, "Error creating file");
+    }
+    return fd;
+}
+
+void close_file(int fd)
+{
+    close(fd);
+    count_syscalls(1);
+    release_file();
+}
+
+// writes member whose data lies at data_offset in the mapped archive,
+// safe to be called from writer threads as it doesn't touch reader's position
+void write_mapped_file(struct Reader *reader, int directory, char *name, long data_offset, long file_size,
+                       struct Metadata *metadata)
+{
+    int fd = create_file(directory, name);
+
+    preallocate(fd, 0, file_size);
+
+    long started = stats_clock();
+
+    copy_mapped_data(reader, fd, data_offset, file_size);
+    restore_metadata(fd, name, metadata);
+    close_file(fd);
+    add_time(&stats.write_time, started);
+}
+
+// name is relative to the directory, as are names of the functions below
+void extract_file(struct Reader *reader, int directory, char *name, long file_size, struct Metadata *metadata)
+{
+    long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;      // number of blocks containing file data
+
+    // data never passes through user space unless the kernel refuses to copy it,
+    // only the partial last block is special: its padding is skipped, not written
+    if (reader->mapped)
+    {
+        long data_offset = reader->offset;
+
+        skip_blocks(reader, blocks_count);              // check that data is present in the archive
+        write_mapped_file(reader, directory, name, data_offset, file_size, metadata);
+        return;
+    }
+
+    int fd = create_file(directory, name);
+
+    preallocate(fd, 0, file_size);
+
+    long started = stats_clock();
+
+    copy_stream_data(reader, fd, file_size);
+    restore_metadata(fd, name, metadata);
+    close_file(fd);
+    add_time(&stats.write_time, started);
+}
+
+// writes data regions of a sparse member at their offsets, holes between them are
+// left unwritten and the file is extended to its real size at the end
+void extract_sparse_file(struct Reader *reader, int directory, char *name, long file_size, struct SparseMap *map,
+                         struct Metadata *metadata)
+{
+    long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long data_offset = reader->offset;
+    int fd = create_file(directory, name);
+    long started = stats_clock();
+
+    if (reader->mapped)
+    {
+        skip_blocks(reader, blocks_count);              // check that data is present in the archive
+    }
+
+    for (long i = 0; i < map->count; i++)
+    {
+        struct Region *region = &map->regions[i];
+
+        count_syscalls(1);
+
+        if (lseek(fd, region->offset, SEEK_SET) < 0)
+        {
+            errx(2, "Error writing file");
+        }
+        preallocate(fd, region->offset, region->size);
+
+        if (reader->mapped)
+        {
+            copy_mapped_data(reader, fd, data_offset, region->size);
+            data_offset += region->size;
+        }
+        else
+        {
+            copy_stream_bytes(reader, fd, region->size);
+        }
+    }
+
+    if (!reader->mapped)
+    {
+        skip_padding(reader, file_size);
+    }
+
+    if (ftruncate(fd, map->real_size) < 0)
+    {
+        errx(2, "Error writing file");
+    }
+    count_syscalls(1);
+    restore_metadata(fd, name, metadata);
+    close_file(fd);
+    add_time(&stats.write_time, started);
+}
+
+void make_directory(int directory, char *name)
+{
+    long started = stats_clock();
+
+    if (mkdirat(directory, name, 0777) < 0 && errno != EEXIST)
+    {
+        errx(2, "Error creating directory");
+    }
+    count_syscalls(1);
+    throttle(0, 1);
+    add_time(&stats.create_time, started);
+}
+
+// an existing file of the same name is replaced, as when a regular file is extracted,
+// target of a hard link is a member name, so it is relative to the extraction root and
+// its parent is opened like those of members, an extracted symbolic link can't lead out of the root
+void make_link(int root, char *target, int directory, char *name, bool symbolic, struct Metadata *metadata)
+{
+    long started = stats_clock();
+    char *slash = symbolic ? NULL : strrchr(target, '/');
+    int from = root;
+
+    // target may lie in the mapped archive, which can't be written
+    if (slash != NULL)
+    {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%.*s", (int)(slash - target), target);
+        from = open_parent(root, path, false);
+
+        if (from < 0)
+        {
+            errx(2, "Error creating link");
+        }
+    }
+
+    unlinkat(directory, name, 0);
+
+    if ((symbolic ? symlinkat(target, directory, name) : linkat(from, slash != NULL ? slash + 1 : target,
+                                                                    directory, name, 0)) < 0)
+    {
+        errx(2, "Error creating link");
+    }
+    count_syscalls(2);
+    throttle(0, 1);
+
+    if (from != root)
+    {
+        close(from);
+        count_syscalls(1);
+    }
+
+    // hard link shares attributes of its target
+    if (symbolic)
+    {
+        restore_metadata_at(directory, name, metadata, true);
+    }
+    add_time(&stats.create_time, started);
+}
+
+// differences are part of the output of -d, like names are of -t
+void report_difference(char *name, char *difference)
+{
+    fprintf(report != NULL ? report : stdout, "%s: %s\n", name, difference);
+}
+
+// reports attributes of a file on disk which differ from those of its member, false if some do
+bool compare_attributes(char *name, struct stat *st, struct Metadata *metadata)
+{
+    bool same = true;
+
+    if ((st->st_mode & 07777) != metadata->mode)
+    {
+        report_difference(name, "Mode differs");
+        same = false;
+    }
+    if (st->st_uid != metadata->uid)
+    {
+        report_difference(name, "Uid differs");
+        same = false;
+    }
+    if (st->st_gid != metadata->gid)
+    {
+        report_difference(name, "Gid differs");
+        same = false;
+    }
+    if (st->st_mtim.tv_sec != metadata->mtime || (metadata->mtime_nsec != 0 && st->st_mtim.tv_nsec != metadata->mtime_nsec))
+    {
+        report_difference(name, "Mod time differs");
+        same = false;
+    }
+
+    return same;
+}
+
+// file of a member being compared, name + leaf is its name relative to parent,
+// missing parent means that the file is missing too
+bool stat_compared(struct Directory *parent, char *name, long leaf, struct stat *st)
+{
+    count_syscalls(1);
+
+    if (parent == NULL || fstatat(parent->fd, name + leaf, st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        warnx("%s: Cannot stat", name);
+        return false;
+    }
+    return true;
+}
+
+// opens file of a regular member for comparison, differing attributes are reported and make same false,
+// -1 if the file can't be read or its size differs, its contents are then not compared
+int open_compared(struct Directory *parent, char *name, long leaf, long size, struct Metadata *metadata, bool *same)
+{
+    struct stat st;
+    int fd = parent != NULL ? openat(parent->fd, name + leaf, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+
+    count_syscalls(2);
+    *same = false;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        warnx("%s: Cannot open", name);
+    }
+    else if (!S_ISREG(st.st_mode))
+    {
+        report_difference(name, "File type differs");
+    }
+    else
+    {
+        *same = compare_attributes(name, &st, metadata);
+
+        if (st.st_size == size)
+        {
+            return fd;
+        }
+        report_difference(name, "Size differs");
+        *same = false;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return -1;
+}
+
+// compares size bytes of an open file from offset with data, in pieces read into buffer
+bool same_contents(int fd, long offset, char *data, long size, char *buffer)
+{
+    for (long done = 0; done < size; )
+    {
+        long chunk = size - done < COMPARE_CHUNK ? size - done : COMPARE_CHUNK;
+        ssize_t bytes = pread(fd, buffer, chunk, offset + done);
+
+        count_syscalls(1);
+        throttle(bytes > 0 ? bytes : 0, 1);
+
+        if (bytes <= 0 || memcmp(buffer, data + done, bytes) != 0)
+        {
+            return false;
+        }
+        done += bytes;
+    }
+    return true;
+}
+
+// true if the file reads as zeros from offset to end, holes on disk are passed over without reading
+bool zero_range(int fd, long offset, long end, char *buffer)
+{
+    while (offset < end)
+    {
+        long data = lseek(fd, offset, SEEK_DATA);
+
+        count_syscalls(2);
+
+        if ((data < 0 && errno == ENXIO) || data >= end)
+        {
+            return true;
+        }
+
+        // file system may not know where its holes are
+        offset = data < 0 ? offset : data;
+
+        long chunk = end - offset < COMPARE_CHUNK ? end - offset : COMPARE_CHUNK;
+        ssize_t bytes = pread(fd, buffer, chunk, offset);
+
+        if (bytes <= 0 || buffer[0] != 0 || memcmp(buffer, buffer + 1, bytes - 1) != 0)
+        {
+            return false;
+        }
+        offset += bytes;
+    }
+    return true;
+}
+
+// compares next size bytes of the archive stream with the file from offset,
+// all of them are consumed even when a difference is found early
+bool compare_stream_bytes(struct Reader *reader, int fd, long offset, long size, char *buffer)
+{
+    bool same = true;
+
+    for (long left = size; left > 0; )
+    {
+        long count;
+        char *data = take_bytes(reader, left, &count);
+
+        if (count == 0)
+        {
+            unexpected_eof();
+        }
+        same = same && same_contents(fd, offset, data, count, buffer);
+        offset += count;
+        left -= count;
+    }
+
+    return same;
+}
+
+// compares a regular file with its member whose data lies in the mapped archive,
+// safe to be called from worker threads, true if they are the same
+bool compare_mapped_file(struct Directory *parent, char *name, long leaf, char *data, long file_size,
+                         struct Metadata *metadata, char *buffer)
+{
+    bool same;
+    int fd = open_compared(parent, name, leaf, file_size, metadata, &same);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (!same_contents(fd, 0, data, file_size, buffer))
+    {
+        report_difference(name, "Contents differ");
+        same = false;
+    }
+    close(fd);
+    count_syscalls(1);
+    return same;
+}
+
+bool compare_file(struct Reader *reader, struct Directory *parent, char *name, long leaf, long file_size,
+                  struct Metadata *metadata, char *buffer)
+{
+    long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (reader->mapped)
+    {
+        long data_offset = reader->offset;
+
+        skip_blocks(reader, blocks_count);              // check that data is present in the archive
+        return compare_mapped_file(parent, name, leaf, reader->map + data_offset, file_size, metadata, buffer);
+    }
+
+    bool same;
+    int fd = open_compared(parent, name, leaf, file_size, metadata, &same);
+
+    if (fd < 0)
+    {
+        skip_blocks(reader, blocks_count);
+        return false;
+    }
+
+    if (!compare_stream_bytes(reader, fd, 0, file_size, buffer))
+    {
+        report_difference(name, "Contents differ");
+        same = false;
+    }
+    skip_padding(reader, file_size);
+    close(fd);
+    count_syscalls(1);
+    return same;
+}
+
+// data regions of a sparse member are compared at their offsets, the file must read as zeros between them
+bool compare_sparse_file(struct Reader *reader, struct Directory *parent, char *name, long leaf, long file_size,
+                         struct SparseMap *map, struct Metadata *metadata, char *buffer)
+{
+    long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long data_offset = reader->offset;
+    bool same;
+    int fd = open_compared(parent, name, leaf, map->real_size, metadata, &same);
+    bool contents = true;
+    long position = 0;                  // end of the previous region
+
+    if (fd < 0 || reader->mapped)
+    {
+        skip_blocks(reader, blocks_count);
+    }
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    for (long i = 0; i < map->count; i++)
+    {
+        struct Region *region = &map->regions[i];
+
+        contents = contents && zero_range(fd, position, region->offset, buffer);
+        position = region->offset + region->size;
+
+        if (reader->mapped)
+        {
+            contents = contents && same_contents(fd, region->offset, reader->map + data_offset, region->size, buffer);
+            data_offset += region->size;
+        }
+        else
+        {
+            contents = compare_stream_bytes(reader, fd, region->offset, region->size, buffer) && contents;
+        }
+    }
+
+    if (!reader->mapped)
+    {
+        skip_padding(reader, file_size);
+    }
+
+    contents = contents && zero_range(fd, position, map->real_size, buffer);
+
+    if (!contents)
+    {
+        report_difference(name, "Contents differ");
+        same = false;
+    }
+    close(fd);
+    count_syscalls(1);
+    return same;
+}
+
+// symbolic link must point to the same target, hard link must be the same file as its target
+bool compare_link(int root, char *target, struct Directory *parent, char *name, long leaf, bool symbolic)
+{
+    struct stat st;
+
+    if (!stat_compared(parent, name, leaf, &st))
+    {
+        return false;
+    }
+
+    if (symbolic)
+    {
+        char buffer[PATH_MAX];
+        ssize_t length = S_ISLNK(st.st_mode) ? readlinkat(parent->fd, name + leaf, buffer, sizeof(buffer)) : -1;
+
+        count_syscalls(1);
+
+        if (length != (ssize_t)strlen(target) || memcmp(buffer, target, length) != 0)
+        {
+            report_difference(name, "Symlink differs");
+            return false;
+        }
+        return true;
+    }
+
+    struct stat target_st;
+
+    count_syscalls(1);
+
+    if (fstatat(root, target, &target_st, AT_SYMLINK_NOFOLLOW) != 0
+        || target_st.st_dev != st.st_dev || target_st.st_ino != st.st_ino)
+    {
+        fprintf(report != NULL ? report : stdout, "%s: Not linked to %s\n", name, target);
+        return false;
+    }
+    return true;
+}
+
+bool compare_directory(struct Directory *parent, char *name, long leaf, struct Metadata *metadata)
+{
+    struct stat st;
+
+    if (!stat_compared(parent, name, leaf, &st))
+    {
+        return false;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        report_difference(name, "File type differs");
+        return false;
+    }
+
+    // mtime of a directory changes whenever something is added to it
+    if ((st.st_mode & 07777) != metadata->mode)
+    {
+        report_difference(name, "Mode differs");
+        return false;
+    }
+    return true;
+}
+
+// returns zeroed submission entry, there is always room as every slot needs at most URING_OPS
+struct io_uring_sqe *get_sqe(struct Uring *uring)
+{
+    unsigned tail = *uring->sq_tail + uring->queued;
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[index] = index;
+    uring->queued++;
+    return sqe;
+}
+
+// submits the one prepared operation and waits for it, for probing before the ring is used
+int run_uring_operation(struct Uring *uring)
+{
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + uring->queued, __ATOMIC_RELEASE);
+
+    unsigned queued = uring->queued;
+
+    uring->queued = 0;
+
+    while (syscall(__NR_io_uring_enter, uring->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -errno;
+        }
+        queued = 0;
+    }
+    count_syscalls(1);
+
+    unsigned head = *uring->cq_head;
+    int result = uring->cqes[head & *uring->cq_mask].res;
+
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return result;
+}
+
+// the operations are there since 5.6, but openat and close only use registered files since 5.15,
+// older kernels ignore file_index and open a plain descriptor, so one file is opened and closed for a try
+bool probe_uring(struct Uring *uring)
+{
+    int needed[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE };
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe)
+                                             + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+
+    if (probe == NULL)
+    {
+        errx(2, "calloc");
+    }
+
+    bool supported = syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+
+    for (unsigned i = 0; i < sizeof(needed) / sizeof(needed[0]) && supported; i++)
+    {
+        supported = needed[i] < probe->ops_len && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    if (!supported)
+    {
+        return false;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(uring);
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)"/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+
+    int result = run_uring_operation(uring);
+
+    if (result != 0)
+    {
+        if (result > 0)
+        {
+            close(result);
+        }
+        return false;
+    }
+
+    sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    return run_uring_operation(uring) == 0;
+}
+
+// sets up the ring and a table of registered files, returns false if the kernel can't do it
+bool open_uring(struct Uring *uring)
+{
+    struct io_uring_params params = { 0 };
+
+    memset(uring, 0, sizeof(*uring));
+    uring->fd = syscall(__NR_io_uring_setup, URING_DEPTH * URING_OPS, &params);
+
+    if (uring->fd < 0)
+    {
+        return false;
+    }
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->fd, IORING_OFF_CQ_RING);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->fd, IORING_OFF_SQES);
+
+    // no files registered yet, each slot gets its file from openat
+    int files[URING_DEPTH];
+
+    memset(files, -1, sizeof(files));
+
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED
+        || syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES, files, URING_DEPTH) != 0)
+    {
+        close(uring->fd);
+        return false;
+    }
+
+    uring->depth = limits.open_files > 0 && limits.open_files < URING_DEPTH ? limits.open_files : URING_DEPTH;
+    uring->sq_head = (unsigned*)(uring->sq_ring + params.sq_off.head);
+    uring->sq_tail = (unsigned*)(uring->sq_ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned*)(uring->sq_ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned*)(uring->sq_ring + params.sq_off.array);
+    uring->cq_head = (unsigned*)(uring->cq_ring + params.cq_off.head);
+    uring->cq_tail = (unsigned*)(uring->cq_ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned*)(uring->cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)(uring->cq_ring + params.cq_off.cqes);
+
+    if (!probe_uring(uring))
+    {
+        munmap(uring->sqes, uring->sqes_size);
+        munmap(uring->cq_ring, uring->cq_ring_size);
+        munmap(uring->sq_ring, uring->sq_ring_size);
+        close(uring->fd);
+        return false;
+    }
+    return true;
+}
+
+// submits prepared operations and waits for at least min_complete of them,
+// then handles everything that completed
+void submit_uring(struct Uring *uring, unsigned min_complete)
+{
+    __atomic_store_n(uring->sq_tail, *uring->sq_tail + uring->queued, __ATOMIC_RELEASE);
+
+    unsigned queued = uring->queued;
+    long started = stats_clock();
+
+    uring->queued = 0;
+
+    while (syscall(__NR_io_uring_enter, uring->fd, queued, min_complete, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            errx(2, "io_uring_enter");
+        }
+        queued = 0;
+    }
+    count_syscalls(1);
+    add_time(&stats.write_time, started);
+
+    unsigned head = *uring->cq_head;
+
+    while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+        struct UringSlot *slot = &uring->slots[cqe->user_data / URING_OPS];
+        int op = cqe->user_data % URING_OPS;
+
+        // operations following a failed one in the chain are cancelled, only the cause is reported
+        if (op == URING_OPEN && cqe->res == -ELOOP)
+        {
+            slot->replace = true;
+        }
+        else if (op == URING_OPEN && cqe->res < 0)
+        {
+            errx(2, "Error creating file");
+        }
+        if (op == URING_WRITE && cqe->res != slot->size && cqe->res != -ECANCELED)
+        {
+            errx(2, "Error writing file");
+        }
+
+        // there are no operations changing attributes, they are set once the file is closed
+        if (--slot->pending == 0 && slot->replace)
+        {
+            int fd = create_file(slot->parent->fd, slot->name + slot->leaf);
+
+            write_all(fd, slot->data, slot->size);
+            restore_metadata(fd, slot->name, &slot->metadata);
+            close_file(fd);
+        }
+        else if (slot->pending == 0)
+        {
+            restore_metadata_at(slot->parent->fd, slot->name + slot->leaf, &slot->metadata, false);
+        }
+
+        if (slot->pending == 0)
+        {
+            release_directory(slot->parent);
+            uring->busy--;
+            uring->bytes -= slot->size;
+        }
+        head++;
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// waits until all files being created are closed
+void drain_uring(struct Uring *uring)
+{
+    while (uring->busy > 0 || uring->queued > 0)
+    {
+        submit_uring(uring, 1);
+    }
+}
+
+void close_uring(struct Uring *uring)
+{
+    drain_uring(uring);
+    munmap(uring->sqes, uring->sqes_size);
+    munmap(uring->cq_ring, uring->cq_ring_size);
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->fd);
+}
+
+// queues creation of a small member with data taken straight from the mapped archive
+// a member of the same name still being created is finished first, so that later entries
+// overwrite earlier ones as they do when extracting serially
+void uring_extract(struct Uring *uring, struct Directory *parent, char *name, long leaf, char *data, long size,
+                   struct Metadata *metadata)
+{
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        if (uring->slots[i].pending > 0 && strcmp(uring->slots[i].name, name) == 0)
+        {
+            drain_uring(uring);
+            break;
+        }
+    }
+
+    // submit a batch once every slot holds a member, then wait for one of them to be closed
+    while (uring->busy == uring->depth || (limits.memory > 0 && uring->busy > 0 && uring->bytes + size > limits.memory))
+    {
+        submit_uring(uring, 1);
+    }
+
+    // member is read from the archive and written as a whole by the chain
+    throttle(2 * size, size > 0 ? 2 : 1);
+
+    int index = 0;
+
+    while (uring->slots[index].pending > 0)
+    {
+        index++;
+    }
+
+    struct UringSlot *slot = &uring->slots[index];
+    struct io_uring_sqe *sqe;
+
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    retain_directory(parent);
+    slot->parent = parent;
+    slot->leaf = leaf;
+    slot->metadata = *metadata;
+    slot->data = data;
+    slot->size = size;
+    slot->pending = size > 0 ? URING_OPS : URING_OPS - 1;
+    slot->replace = false;
+    uring->busy++;
+    uring->bytes += size;
+
+    sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = parent->fd;
+    sqe->addr = (unsigned long)(slot->name + leaf);
+    sqe->len = 0666;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    sqe->file_index = index + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = index * URING_OPS + URING_OPEN;
+
+    if (size > 0)
+    {
+        sqe = get_sqe(uring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = index;
+        sqe->addr = (unsigned long)data;
+        sqe->len = size;
+        sqe->off = 0;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->user_data = index * URING_OPS + URING_WRITE;
+    }
+
+    sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = index + 1;
+    sqe->user_data = index * URING_OPS + URING_CLOSE;
+}
+
+// prints outputs that are done in archive order, with wait, the oldest one is waited for first
+void print_outputs(struct Pool *pool, bool wait)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (wait && pool->outputs_count > 0 && !pool->outputs[pool->first_output].done)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+
+    while (pool->outputs_count > 0 && pool->outputs[pool->first_output].done)
+    {
+        struct Output *output = &pool->outputs[pool->first_output];
+
+        pthread_mutex_unlock(&pool->lock);
+        fclose(output->stream);
+        fwrite(output->text, 1, output->length, stdout);
+        free(output->text);
+        pthread_mutex_lock(&pool->lock);
+
+        pool->first_output = (pool->first_output + 1) % pool->outputs_capacity;
+        pool->outputs_count--;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// takes the output of the next member in archive order, outputs before it are printed as they get done
+struct Output *next_output(struct Pool *pool)
+{
+    print_outputs(pool, pool->outputs_count == pool->outputs_capacity);
+
+    // only the scanner adds outputs, workers just mark them done
+    struct Output *output = &pool->outputs[(pool->first_output + pool->outputs_count) % pool->outputs_capacity];
+
+    output->done = false;
+    output->stream = open_memstream(&output->text, &output->length);
+
+    if (output->stream == NULL)
+    {
+        errx(2, "open_memstream");
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->outputs_count++;
+    pthread_mutex_unlock(&pool->lock);
+    return output;
+}
+
+void finish_output(struct Pool *pool, struct Output *output)
+{
+    pthread_mutex_lock(&pool->lock);
+    output->done = true;
+    pthread_cond_signal(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void *worker_main(void *arg)
+{
+    struct Worker *worker = arg;
+
+    pthread_mutex_lock(&worker->lock);
+
+    while (true)
+    {
+        while (worker->count == 0 && !worker->done)
+        {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        }
+
+        if (worker->count == 0)
+        {
+            break;
+        }
+
+        // job stays in the queue while it is written, so the slot can't be reused
+        struct Job *job = &worker->jobs[worker->first];
+
+        pthread_mutex_unlock(&worker->lock);
+
+        if (worker->compare)
+        {
+            report = job->output->stream;
+            worker->differences += !compare_mapped_file(job->parent, job->name, job->leaf,
+                                                        worker->reader->map + job->offset, job->size,
+                                                        &job->metadata, worker->buffer);
+            report = NULL;
+            finish_output(worker->pool, job->output);
+        }
+        else
+        {
+            write_mapped_file(worker->reader, job->parent->fd, job->name + job->leaf, job->offset, job->size,
+                              &job->metadata);
+        }
+        release_directory(job->parent);
+        release_memory(job->size);
+        pthread_mutex_lock(&worker->lock);
+
+        worker->first = (worker->first + 1) % QUEUE_LENGTH;
+        worker->count--;
+        pthread_cond_signal(&worker->changed);
+    }
+
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+// with compare, workers compare files on disk with members instead of writing them
+void start_pool(struct Pool *pool, struct Reader *reader, int count, bool compare)
+{
+    pool->count = count;
+    pool->differences = 0;
+    pool->workers = calloc(count, sizeof(struct Worker));
+
+    // every queued job may hold an output, and the scanner one more
+    pool->outputs_capacity = compare ? (long)count * QUEUE_LENGTH + 1 : 0;
+    pool->outputs = calloc(pool->outputs_capacity > 0 ? pool->outputs_capacity : 1, sizeof(struct Output));
+    pool->first_output = 0;
+    pool->outputs_count = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    if (pool->workers == NULL || pool->outputs == NULL)
+    {
+        errx(2, "calloc");
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct Worker *worker = &pool->workers[i];
+
+        worker->reader = reader;
+        worker->pool = pool;
+        worker->compare = compare;
+
+        if (compare && (worker->buffer = malloc(COMPARE_CHUNK)) == NULL)
+        {
+            errx(2, "malloc");
+        }
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->changed, NULL);
+
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+        {
+            errx(2, "pthread_create");
+        }
+    }
+}
+
+// queues member for writing, blocks while the chosen worker's queue is full
+// or while members queued by now hold as much data as --max-memory allows
+// with output, the member is compared and what is found is collected there
+void submit_job(struct Pool *pool, struct Directory *parent, char *name, long leaf, long data_offset, long file_size,
+                struct Metadata *metadata, struct Output *output)
+{
+    struct Worker *worker = &pool->workers[hash_name(name) % pool->count];
+
+    reserve_memory(file_size);
+    pthread_mutex_lock(&worker->lock);
+
+    while (worker->count == QUEUE_LENGTH)
+    {
+        pthread_cond_wait(&worker->changed, &worker->lock);
+    }
+
+    struct Job *job = &worker->jobs[(worker->first + worker->count) % QUEUE_LENGTH];
+
+    snprintf(job->name, sizeof(job->name), "%s", name);
+    retain_directory(parent);
+    job->parent = parent;
+    job->leaf = leaf;
+    job->metadata = *metadata;
+    job->offset = data_offset;
+    job->size = file_size;
+    job->output = output;
+    worker->count++;
+
+    pthread_cond_signal(&worker->changed);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// waits until all submitted files are written
+void drain_pool(struct Pool *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        struct Worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+
+        while (worker->count > 0)
+        {
+            pthread_cond_wait(&worker->changed, &worker->lock);
+        }
+
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// waits until all queued members are written and stops the workers
+void finish_pool(struct Pool *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        struct Worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        worker->done = true;
+        pthread_cond_signal(&worker->changed);
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    for (int i = 0; i < pool->count; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        pthread_cond_destroy(&pool->workers[i].changed);
+        pool->differences += pool->workers[i].differences;
+        free(pool->workers[i].buffer);
+    }
+
+    print_outputs(pool, false);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->outputs);
+    free(pool->workers);
+}
+
+// maps index sidecar, returns false if it doesn't exist, is damaged
+// or was built for a different version of the archive
+bool open_index(struct Index *index, char *path, struct Reader *reader)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size < (long)sizeof(struct IndexHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    index->size = st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (index->map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    struct IndexHeader *header = (struct IndexHeader*)index->map;
+    long names_start = sizeof(struct IndexHeader) + sizeof(uint32_t) * (long)header->buckets_count
+                       + sizeof(struct IndexEntry) * (long)header->entries_count;
+
+    index->header = header;
+    index->buckets = (uint32_t*)(header + 1);
+    index->entries = (struct IndexEntry*)(index->buckets + header->buckets_count);
+    index->names = index->map + names_start;
+    index->names_size = index->size - names_start;
+
+    // names area must end with zero byte, so that every name in it is terminated
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->archive_size != reader->size || header->archive_mtime != reader->mtime
+        || header->buckets_count == 0 || (header->buckets_count & (header->buckets_count - 1)) != 0
+        || index->names_size < 1 || index->names[index->names_size - 1] != '\0')
+    {
+        munmap(index->map, index->size);
+        return false;
+    }
+
+    return true;
+}
+
+void close_index(struct Index *index)
+{
+    munmap(index->map, index->size);
+}
+
+int compare_offsets(const void *a, const void *b)
+{
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+
+    return (x > y) - (x < y);
+}
+
+void add_offset(long **offsets, long *count, long *capacity, long offset)
+{
+    if (*count == *capacity)
+    {
+        *capacity *= 2;
+        *offsets = realloc(*offsets, sizeof(long) * *capacity);
+
+        if (*offsets == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+    (*offsets)[(*count)++] = offset;
+}
+
+// adds offsets of indexed members named exactly name, returns true if there is one
+bool lookup_member(struct Index *index, char *name, long **offsets, long *count, long *capacity)
+{
+    uint32_t bucket = hash_name(name) & (index->header->buckets_count - 1);
+    uint32_t steps = 0;
+    bool found = false;
+
+    // damaged chain ends where it would leave the entries or loop
+    for (uint32_t i = index->buckets[bucket]; i != 0 && i <= index->header->entries_count
+         && steps < index->header->entries_count; i = index->entries[i - 1].next, steps++)
+    {
+        struct IndexEntry *entry = &index->entries[i - 1];
+
+        // offset beyond the end of archive just reads as EOF
+        if (entry->name < index->names_size && entry->offset >= 0 && entry->offset % BLOCK_SIZE == 0
+            && strcmp(index->names + entry->name, name) == 0)
+        {
+            add_offset(offsets, count, capacity, entry->offset);
+            found = true;
+        }
+    }
+    return found;
+}
+
+// adds members selected by a literal argument through the hash buckets, returns false
+// if members below it might be missed: it names a directory or it is not indexed at all
+// (it may then be a directory without its own member), these are found by a scan
+bool lookup_literal(struct Index *index, char *argument, long **offsets, long *count, long *capacity)
+{
+    char name[PATH_MAX + 1];
+    long length = strlen(argument);
+
+    while (length > 1 && argument[length - 1] == '/')
+    {
+        length--;
+    }
+    if (length >= PATH_MAX)
+    {
+        return false;
+    }
+
+    memcpy(name, argument, length);
+    name[length] = '\0';
+
+    bool file = lookup_member(index, name, offsets, count, capacity);
+
+    name[length] = '/';
+    name[length + 1] = '\0';
+
+    return !lookup_member(index, name, offsets, count, capacity) && file;
+}
+
+// collects header offsets of indexed members selected by file arguments, literal ones naming files
+// are looked up by hash, all names in the index go through the automaton only when
+// some argument is a pattern or a directory,
+// returns their number, offsets are sorted in archive order and each appears once
+long find_members(struct Index *index, struct FileSet *files, long **offsets)
+{
+    long count = 0;
+    long capacity = 64;
+
+    bool scanning = false;
+
+    *offsets = malloc(sizeof(long) * capacity);
+
+    if (*offsets == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    for (int i = 0; i < files->count; i++)
+    {
+        bool literal = !files->wildcards || strpbrk(files->names[i], "*?[\\") == NULL;
+
+        if (!literal || !lookup_literal(index, files->names[i], offsets, &count, &capacity))
+        {
+            scanning = true;
+        }
+    }
+
+    // members found by hash are found again, duplicates are dropped below
+    for (uint32_t i = 0; scanning && i < index->header->entries_count; i++)
+    {
+        struct IndexEntry *entry = &index->entries[i];
+
+        // offset beyond the end of archive just reads as EOF
+        if (entry->name < index->names_size && entry->offset >= 0 && entry->offset % BLOCK_SIZE == 0
+            && match_name(files, index->names + entry->name, false))
+        {
+            add_offset(offsets, &count, &capacity, entry->offset);
+        }
+    }
+
+    qsort(*offsets, count, sizeof(long), compare_offsets);
+
+    long unique = 0;
+
+    for (long i = 0; i < count; i++)
+    {
+        if (unique == 0 || (*offsets)[unique - 1] != (*offsets)[i])
+        {
+            (*offsets)[unique++] = (*offsets)[i];
+        }
+    }
+    return unique;
+}
+
+void init_builder(struct IndexBuilder *builder)
+{
+    memset(builder, 0, sizeof(*builder));
+}
+
+void free_builder(struct IndexBuilder *builder)
+{
+    free(builder->entries);
+    free(builder->names);
+}
+
+void add_to_index(struct IndexBuilder *builder, char *name, long offset, long size, long mtime, uint64_t hash)
+{
+    long length = strlen(name) + 1;
+
+    if (builder->entries_count == builder->entries_capacity)
+    {
+        builder->entries_capacity = builder->entries_capacity == 0 ? 1024 : builder->entries_capacity * 2;
+        builder->entries = realloc(builder->entries, sizeof(struct IndexEntry) * builder->entries_capacity);
+
+        if (builder->entries == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+
+    while (builder->names_size + length > builder->names_capacity)
+    {
+        builder->names_capacity = builder->names_capacity == 0 ? 65536 : builder->names_capacity * 2;
+        builder->names = realloc(builder->names, builder->names_capacity);
+
+        if (builder->names == NULL)
+        {
+            errx(2, "realloc");
+        }
+    }
+
+    struct IndexEntry *entry = &builder->entries[builder->entries_count++];
+
+    entry->offset = offset;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->hash = hash;
+    entry->name = builder->names_size;
+    entry->next = 0;
+
+    memcpy(builder->names + builder->names_size, name, length);
+    builder->names_size += length;
+}
+
+// links collected entries into hash chains, so that they can be looked up like a mapped index,
+// the view points into the builder, which must not grow while the view is used
+void view_builder(struct IndexBuilder *builder, struct Index *index, struct IndexHeader *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->entries_count = builder->entries_count;
+    header->buckets_count = 1;
+
+    while (header->buckets_count < builder->entries_count)
+    {
+        header->buckets_count *= 2;
+    }
+
+    index->map = NULL;
+    index->size = 0;
+    index->header = header;
+    index->buckets = calloc(header->buckets_count, sizeof(uint32_t));
+    index->entries = builder->entries;
+    index->names = builder->names;
+    index->names_size = builder->names_size;
+
+    if (index->buckets == NULL)
+    {
+        errx(2, "calloc");
+    }
+
+    // prepending from the last entry keeps chains in archive order
+    for (long i = builder->entries_count - 1; i >= 0; i--)
+    {
+        uint32_t bucket = hash_name(builder->names + builder->entries[i].name) & (header->buckets_count - 1);
+
+        builder->entries[i].next = index->buckets[bucket];
+        index->buckets[bucket] = i + 1;
+    }
+}
+
+// modification time of the last member of given name, -1 if there is none
+long member_mtime(struct Index *index, char *name)
+{
+    long mtime = -1;
+    uint32_t bucket = hash_name(name) & (index->header->buckets_count - 1);
+
+    for (uint32_t i = index->buckets[bucket]; i != 0; i = index->entries[i - 1].next)
+    {
+        if (strcmp(index->names + index->entries[i - 1].name, name) == 0)
+        {
+            mtime = index->entries[i - 1].mtime;
+        }
+    }
+
+    return mtime;
+}
+
+// writes collected entries to the index sidecar of an archive of given size and mtime,
+// replacing the old one atomically
+// failure is only reported, the archive itself was processed successfully
+void write_index(struct IndexBuilder *builder, char *path, long archive_size, long archive_mtime)
+{
+    struct IndexHeader header;
+    struct Index view;
+
+    view_builder(builder, &view, &header);
+    header.archive_size = archive_size;
+    header.archive_mtime = archive_mtime;
+
+    uint32_t *buckets = view.buckets;
+
+    // empty names area would be rejected as damaged
+    char empty = '\0';
+    char *names = builder->names_size > 0 ? builder->names : &empty;
+    long names_size = builder->names_size > 0 ? builder->names_size : 1;
+
+    char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+
+    if (tmp_path == NULL)
+    {
+        errx(2, "malloc");
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fout = fopen(tmp_path, "w");
+    bool written = fout != NULL
+                   && fwrite(&header, sizeof(header), 1, fout) == 1
+                   && fwrite(buckets, sizeof(uint32_t), header.buckets_count, fout) == header.buckets_count
+                   && fwrite(builder->entries, sizeof(struct IndexEntry), builder->entries_count, fout)
+                      == (size_t)builder->entries_count
+                   && fwrite(names, names_size, 1, fout) == 1;
+
+    if (fout != NULL && fclose(fout) != 0)
+    {
+        written = false;
+    }
+
+    if (!written || rename(tmp_path, path) != 0)
+    {
+        warnx("%s: Cannot write index", path);
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(buckets);
+}
+
+// offset of the header that follows the block at offset if it looks like a header of a member
+// which fits the archive, -1 otherwise, size from pax records is passed to the next member in pax_size
+long next_header(struct Reader *reader, long offset, long *pax_size)
+{
+    struct Header *header = (struct Header*)(reader->map + offset);
+
+    if (offset > reader->size - BLOCK_SIZE
+        || (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 && !is_posix_header(header))
+        || !valid_checksum(header, block_sum((char*)header)))
+    {
+        return -1;
+    }
+
+    bool extended = is_extended_header(header);
+    long size = parse_number(header->size, sizeof(header->size));
+    long next = offset + BLOCK_SIZE;
+
+    if (!extended && *pax_size >= 0)
+    {
+        size = *pax_size;
+    }
+
+    // extension blocks of the sparse map come before data
+    if (header->typeflag[0] == SPARSE_FILE[0])
+    {
+        bool more = ((struct SparseHeader*)header)->isextended[0] != '\0';
+
+        while (more && next <= reader->size - BLOCK_SIZE)
+        {
+            more = ((struct SparseExtension*)(reader->map + next))->isextended[0] != '\0';
+            next += BLOCK_SIZE;
+        }
+    }
+
+    if (size < 0 || size > reader->size - next)
+    {
+        return -1;
+    }
+
+    // pax size stays pending through the GNU long name and long link headers
+    if (header->typeflag[0] == PAX_HEADER[0])
+    {
+        struct Extended pax;
+
+        reset_extended(&pax);
+        *pax_size = parse_pax(&pax, reader->map + next, size) ? pax.size : -1;
+    }
+    else if (!extended || header->typeflag[0] == PAX_GLOBAL[0])
+    {
+        *pax_size = -1;
+    }
+
+    return next + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+// looks at every block until something looks like a header, from then on the members are followed,
+// so data is jumped over as in read_archive and only their headers are brought into memory
+void *scan_main(void *arg)
+{
+    struct Scanner *scanner = arg;
+    long offset = scanner->start;
+    long pax_size = -1;
+
+    while (offset < scanner->end)
+    {
+        long next = next_header(scanner->reader, offset, &pax_size);
+
+        if (next < 0)
+        {
+            offset += BLOCK_SIZE;
+            pax_size = -1;
+            continue;
+        }
+
+        if (scanner->count == scanner->capacity)
+        {
+            scanner->capacity = scanner->capacity == 0 ? 1024 : 2 * scanner->capacity;
+            scanner->candidates = realloc(scanner->candidates, scanner->capacity * sizeof(long));
+
+            if (scanner->candidates == NULL)
+            {
+                errx(2, "realloc");
+            }
+        }
+
+        scanner->candidates[scanner->count++] = offset;
+        offset = next;
+    }
+
+    return NULL;
+}
+
+// true if nearly all pages of the part of the mapping are in memory already
+bool is_resident(struct Reader *reader, long start, long length)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    long first = start / page_size;
+    long pages = (start + length + page_size - 1) / page_size - first;
+    unsigned char *vector = malloc(pages);
+    long resident = 0;
+
+    if (vector == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    if (mincore(reader->map + first * page_size, pages * page_size, vector) == 0)
+    {
+        for (long i = 0; i < pages; i++)
+        {
+            resident += vector[i] & 1;
+        }
+    }
+
+    free(vector);
+    return resident * 10 >= pages * 9;
+}
+
+// scans jobs chunks ahead of the reader in parallel, then follows the members from the reader's
+// position through the headers found, which discards anything found inside data,
+// end is set to where the chain of members leaves the scanned part, returns false if it is
+// not worth going on, because the chain broke off (it is left to read_archive) or members are large
+bool scan_ahead(struct Reader *reader, int jobs, long *end)
+{
+    struct Scanner scanners[MAX_JOBS];
+    long start = reader->offset;
+    long scanned = reader->size - start < jobs * SCAN_CHUNK ? reader->size - start : jobs * SCAN_CHUNK;
+    long chunk = (scanned / jobs + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+    if (chunk == 0)
+    {
+        return false;
+    }
+
+    // reading from memory, threads would only repeat what read_archive does
+    if (is_resident(reader, start, scanned))
+    {
+        *end = start + scanned;
+        return true;
+    }
+
+    for (int i = 0; i < jobs; i++)
+    {
+        struct Scanner *scanner = &scanners[i];
+
+        memset(scanner, 0, sizeof(*scanner));
+        scanner->reader = reader;
+        scanner->start = start + i * chunk < start + scanned ? start + i * chunk : start + scanned;
+        scanner->end = scanner->start + chunk < start + scanned ? scanner->start + chunk : start + scanned;
+
+        if (pthread_create(&scanner->thread, NULL, scan_main, scanner) != 0)
+        {
+            errx(2, "pthread_create");
+        }
+    }
+
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_join(scanners[i].thread, NULL);
+    }
+
+    long offset = start;
+    long pax_size = -1;
+    long members = 0;
+    bool found = true;
+
+    while (offset < start + scanned && found)
+    {
+        struct Scanner *scanner = &scanners[(offset - start) / chunk];
+
+        while (scanner->cursor < scanner->count && scanner->candidates[scanner->cursor] < offset)
+        {
+            scanner->cursor++;
+        }
+
+        found = scanner->cursor < scanner->count && scanner->candidates[scanner->cursor] == offset;
+
+        if (found)
+        {
+            offset = next_header(reader, offset, &pax_size);
+            members++;
+        }
+    }
+
+    for (int i = 0; i < jobs; i++)
+    {
+        free(scanners[i].candidates);
+    }
+
+    *end = offset;
+    return found && members > 0 && (offset - start) / members <= SCAN_MAX_SPAN;
+}
+
+// writes name as JSON string, bytes that are not valid UTF-8 are passed as they are
+void print_json_string(FILE *out, char *string)
+{
+    putc('"', out);
+
+    for (unsigned char *c = (unsigned char*)string; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            putc('\\', out);
+            putc(*c, out);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            putc(*c, out);
+        }
+    }
+
+    putc('"', out);
+}
+
+// prints a member, offset is that of its first header including extended ones,
+// hash is NULL unless data of the member was hashed, plain listing is then that of xxhsum
+void print_entry(FILE *out, enum listing listing, char *name, struct Header *header, long size, long mtime,
+                 long offset, uint64_t *hash)
+{
+    if (listing == PLAIN && hash != NULL)
+    {
+        fprintf(out, "%016" PRIx64 "  %s\n", *hash, name);
+        return;
+    }
+
+    if (listing == PLAIN)
+    {
+        fprintf(out, "%s\n", name);
+        return;
+    }
+
+    long mode = parse_number(header->mode, sizeof(header->mode)) & 07777;
+
+    if (listing == NUL_DELIMITED && hash != NULL)
+    {
+        fprintf(out, "%ld %ld %lo %ld %016" PRIx64 " %s%c", size, mtime, mode, offset, *hash, name, '\0');
+        return;
+    }
+
+    if (listing == NUL_DELIMITED)
+    {
+        fprintf(out, "%ld %ld %lo %ld %s%c", size, mtime, mode, offset, name, '\0');
+        return;
+    }
+
+    fputs("{\"name\":", out);
+    print_json_string(out, name);
+    fprintf(out, ",\"type\":\"%c\",\"size\":%ld,\"mtime\":%ld,\"mode\":%ld,\"offset\":%ld",
+           header->typeflag[0] == '\0' ? REG_FILE[0] : header->typeflag[0], size, mtime, mode, offset);
+
+    if (hash != NULL)
+    {
+        fprintf(out, ",\"xxh64\":\"%016" PRIx64 "\"", *hash);
+    }
+    fputs("}\n", out);
+}
+
+void print_stats(long elapsed, long scanned)
+{
+    double seconds = elapsed / 1e9;
+
+    fprintf(stderr, "Entries scanned: %ld\n", stats.entries);
+    fprintf(stderr, "Bytes extracted: %ld\n", stats.extracted);
+    fprintf(stderr, "Bytes skipped: %ld\n", stats.skipped);
+    fprintf(stderr, "Bytes hashed: %ld\n", stats.hashed);
+    fprintf(stderr, "System calls: %ld\n", stats.syscalls);
+    fprintf(stderr, "Reading headers: %.3f s\n", stats.header_time / 1e9);
+    fprintf(stderr, "Skipping data: %.3f s\n", stats.skip_time / 1e9);
+    fprintf(stderr, "Hashing data: %.3f s\n", stats.hash_time / 1e9);
+    fprintf(stderr, "Creating files: %.3f s\n", stats.create_time / 1e9);
+    fprintf(stderr, "Writing data: %.3f s\n", stats.write_time / 1e9);
+    fprintf(stderr, "Printing names: %.3f s\n", stats.print_time / 1e9);
+    fprintf(stderr, "Throttled: %.3f s\n", stats.throttle_time / 1e9);
+    fprintf(stderr, "Total: %.3f s, %ld bytes of archive, %.1f MB/s\n",
+            seconds, scanned, seconds > 0 ? scanned / seconds / 1e6 : 0.0);
+}
+
+// reads whole archive and compare every filename with arguments
+// prints filenames and extracts files if needed
+// with more than one job, members of a mapped archive are written by a pool of threads,
+// with io_uring, small members of a mapped archive are created in batches of linked operations
+// with index requested, members of a mapped or seekable compressed archive are looked up
+// in the index sidecar, if it is missing or stale, it is built during the scan
+// extracted members are created relative to the -C directory, missing parents are made on the way,
+// attributes of files are restored as they are written, those of directories at the end
+// in compare mode, files on disk are compared with members and differences are printed,
+// exits with status 1 if there were any
+// with occurrence option, reading stops as soon as every file argument was found and
+// the members after it are not below a directory argument, the rest of the archive
+// is then neither checked nor indexed
+// with members given, every member is collected there as it would be into the index
+// returns offset where the last member read ends, which is where the end-of-archive blocks start
+long read_archive(struct Reader *reader, char **files_args, int files_count, struct Options *options,
+                  struct IndexBuilder *members)
+{
+    enum mode action = options->action;
+    bool verbose = options->verbose;
+    struct Pool pool;
+    bool parallel = (action == EXTRACT || action == COMPARE) && options->jobs > 1 && reader->mapped;
+    struct Uring uring;
+    bool batched = action == EXTRACT && options->uring && !parallel && reader->mapped;
+    bool scanning = action == LIST && options->jobs > 1 && reader->mapped;
+    long scan_end = 0;                          // headers before it were found by scanning threads
+    long members_end = 0;                       // end of data of the last member
+    long differences = 0;                       // members compared by this thread that differ from files
+    char *compare_buffer = NULL;
+
+    struct Index index;
+    struct IndexBuilder builder;
+    bool indexed = false;                       // only members found in the index are visited
+    bool indexing = false;                      // index is built while scanning
+    long *targets = NULL;                       // header offsets of members found in the index
+    long targets_count = 0;
+    long next_target = 0;
+    char *buffer;                               // current block, points into the mapping or reader's buffer
+    bool first_empty = false;                   // first zero block encountered
+    bool second_empty = false;                  // second zero block encountered
+    int blocks_read = 0;                        // number of blocks read so far
+    struct Header saved_header;                 // header copied out of the record buffer
+    struct SparseMap sparse_map = { 0 };
+    struct Extended extended = { .data = NULL, .capacity = 0 };
+    char name_buffer[PATH_MAX];                 // names that are not terminated in the header
+    char link_buffer[PATH_MAX];
+    struct DirectoryCache directories;          // parents of extracted members
+    bool owner = geteuid() == 0;                // as in tar, only root restores owners and exact modes
+    mode_t mask = 0;
+
+    // used for evidence which files were found in the archive
+    struct FileSet files;
+
+    init_file_set(&files, files_args, files_count, options->wildcards);
+    init_builder(&builder);
+    reset_extended(&extended);
+
+    // files are compared with the attributes they would get from root
+    if (action == COMPARE)
+    {
+        open_directory_cache(&directories, options->directory, false);
+        owner = true;
+
+        if ((compare_buffer = malloc(COMPARE_CHUNK)) == NULL)
+        {
+            errx(2, "malloc");
+        }
+    }
+
+    if (action == EXTRACT)
+    {
+        open_directory_cache(&directories, options->directory, true);
+        mask = umask(0);
+        umask(mask);
+
+        // files of other users must not become set-user-ID programs of the one extracting them
+        mask = owner ? 0 : mask | S_ISUID | S_ISGID;
+    }
+
+    if (parallel)
+    {
+        start_pool(&pool, reader, options->jobs, action == COMPARE);
+    }
+
+    if (batched && !open_uring(&uring))
+    {
+        warnx("io_uring is not available, files are extracted one by one");
+        batched = false;
+    }
+
+    if (options->index_path != NULL && is_seekable(reader))
+    {
+        if (files_count > 0 && open_index(&index, options->index_path, reader))
+        {
+            targets_count = find_members(&index, &files, &targets);
+            close_index(&index);
+            indexed = true;
+        }
+        else
+        {
+            indexing = true;
+        }
+    }
+
+    long archive_started = stats_clock();
+
+    // while block of 512 bytes is successfully read
+    while (true)
+    {
+        // members after the first match of every argument are not wanted,
+        // unless they may be in the subtree of a directory argument
+        if (files_count > 0 && files.missing == 0 && !files.directory_matched && options->occurrence)
+        {
+            indexing = false;
+            break;
+        }
+
+        // jump straight to the next requested member, unless its extended headers were just read
+        if (indexed && extended.offset < 0)
+        {
+            // a member jumped over ends the subtrees of directory arguments, as it does in a scan
+            if (next_target == targets_count
+                || (files_count > 0 && files.missing == 0 && options->occurrence
+                    && targets[next_target] != reader->offset))
+            {
+                break;
+            }
+            seek_reader(reader, targets[next_target++]);
+        }
+
+        // threads find the following headers, so that they are brought into memory in parallel
+        if (scanning && !indexed && reader->offset >= scan_end)
+        {
+            scanning = scan_ahead(reader, options->jobs, &scan_end);
+        }
+
+        long header_offset = reader->offset;
+        long started = stats_clock();
+
+        if ((buffer = read_block(reader)) == NULL)
+        {
+            break;
+        }
+
+        blocks_read++;
+
+        // one pass over the block tells whether it is empty and gives its checksum
+        unsigned long sum = block_sum(buffer);
+
+        if (sum == 0)
+        {
+            if (!first_empty)
+            {
+                first_empty = true;
+                continue;
+            }
+            else
+            {
+                second_empty = true;            // two consecutive empty blocks signalize the end of archive
+                break;
+            }
+        }
+
+        struct Header *header = (struct Header*)buffer;
+
+        is_tar_archive(header);                 // check magic field in header
+
+        if (options->verify_checksum)
+        {
+            check_header(header, sum, header_offset);
+        }
+
+        // long names and pax records are remembered until the member they describe
+        if (is_extended_header(header))
+        {
+            long extended_blocks = (member_size(header) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+            read_extended_header(reader, header, &extended, header_offset);
+            blocks_read += extended_blocks;
+            add_time(&stats.header_time, started);
+            continue;
+        }
+
+        long file_size = extended.size >= 0 ? extended.size : member_size(header);  // size of file in the current entry
+        long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;   // number of blocks with contents of file, rounded up
+        char type = header->typeflag[0];
+        bool sparse = type == SPARSE_FILE[0];
+        bool regular = is_regular_file(header);
+
+        // extension blocks of the sparse map and hashed data may take the header's place in the record buffer
+        if (sparse || options->hash)
+        {
+            saved_header = *header;
+            header = &saved_header;
+        }
+
+        if (sparse)
+        {
+            blocks_read += read_sparse_map(reader, header, &sparse_map);
+        }
+
+        char *name = entry_name(header, &extended, name_buffer);
+
+        // the member starts with its first extended header, so that its name is found there again
+        long entry_offset = extended.offset >= 0 ? extended.offset : header_offset;
+
+        bool all_found = files.missing == 0;
+
+        // filename was found among arguments
+        bool filename_found = mark_file(&files, name);
+
+        // once every argument was found, only the subtrees of directory arguments are read
+        if (files_count > 0 && all_found && !files.below && options->occurrence)
+        {
+            indexing = false;
+            break;
+        }
+        
+        // if there are no arguments or filename was among them, it may be printed
+        bool should_print = (files_count == 0 || filename_found) ? true : false;
+
+        // data of files being listed or indexed is hashed on the way instead of skipped
+        bool hashing = options->hash && (regular || sparse) && (should_print || indexing);
+        uint64_t hash = hashing ? hash_data(reader, file_size) : 0;
+
+        if (indexing || members != NULL)
+        {
+            add_to_index(members != NULL ? members : &builder, name, entry_offset, file_size,
+                         entry_mtime(header, &extended), hash);
+        }
+
+        // when in listing mode, print filename
+        // when in extraction mode, print filename if verbose flag is also set 
+        stats.entries++;
+        add_time(&stats.header_time, started);
+
+        // with writer threads, what is printed about a compared member waits for the earlier ones
+        struct Output *output = action == COMPARE && should_print && parallel ? next_output(&pool) : NULL;
+
+        report = output != NULL ? output->stream : NULL;
+
+        if (should_print && (action == LIST || ((action == EXTRACT || action == COMPARE) && verbose)))
+        {
+            started = stats_clock();
+            print_entry(output != NULL ? output->stream : stdout, options->listing, name, header, sparse ? sparse_map.real_size : file_size,
+                        entry_mtime(header, &extended), entry_offset, hashing ? &hash : NULL);
+            add_time(&stats.print_time, started);
+        }
+
+        struct Directory *parent = NULL;            // member is created there under name + leaf
+        long leaf = 0;
+        struct Metadata metadata;
+        char *link = NULL;                          // target of a link member
+
+        // members go beneath the directory whatever their names, and hard links point there
+        if ((action == EXTRACT || action == COMPARE) && should_print)
+        {
+            char *path = beneath_name(name);
+
+            link = type == HARD_LINK[0] || type == SYMLINK[0] ? entry_link(header, &extended, link_buffer) : NULL;
+
+            if (link != NULL && type == HARD_LINK[0])
+            {
+                link = beneath_name(link);
+            }
+
+            if (path == NULL || (type == HARD_LINK[0] && link == NULL))
+            {
+                warnx("%s: %s contains '..'; skipped", name, path == NULL ? "Member name" : "Link target");
+                should_print = false;
+            }
+            else
+            {
+                name = *path != '\0' ? path : ".";         // "/" is the directory itself
+            }
+        }
+
+        if (action == EXTRACT && should_print)
+        {
+            add_stat(&stats.extracted, file_size);
+        }
+
+        if ((action == EXTRACT || action == COMPARE) && should_print)
+        {
+            parent = parent_directory(&directories, name, &leaf);
+            read_metadata(header, &extended, &metadata, owner, mask);
+        }
+
+        // when in extraction mode, extract file from current entry
+        // else advance to the next file header
+        if (action == EXTRACT && should_print && (sparse || type == HARD_LINK[0] || type == SYMLINK[0]))
+        {
+            // these are made by the scanning thread, earlier entries of the same name must be written first
+            if (parallel)
+            {
+                drain_pool(&pool);
+            }
+            if (batched)
+            {
+                drain_uring(&uring);
+            }
+
+            if (sparse)
+            {
+                extract_sparse_file(reader, parent->fd, name + leaf, file_size, &sparse_map, &metadata);
+            }
+            else
+            {
+                make_link(directories.root->fd, link, parent->fd, name + leaf, type == SYMLINK[0], &metadata);
+                skip_blocks(reader, blocks_count);
+            }
+        }
+        else if (action == EXTRACT && should_print && type == DIRECTORY[0])
+        {
+            make_directory(parent->fd, name + leaf);
+            defer_directory(&directories, name, &metadata);
+            skip_blocks(reader, blocks_count);
+        }
+        else if (action == EXTRACT && should_print && !regular)
+        {
+            warnx("%s: Unsupported header type: %d; skipped", name, type);
+            skip_blocks(reader, blocks_count);
+        }
+        else if (action == EXTRACT && should_print && parallel)
+        {
+            long data_offset = reader->offset;
+
+            skip_blocks(reader, blocks_count);          // check that data is present in the archive
+            submit_job(&pool, parent, name, leaf, data_offset, file_size, &metadata, NULL);
+        }
+        else if (action == EXTRACT && should_print && batched && file_size <= URING_MAX_SIZE)
+        {
+            long data_offset = reader->offset;
+
+            skip_blocks(reader, blocks_count);          // check that data is present in the archive
+            uring_extract(&uring, parent, name, leaf, reader->map + data_offset, file_size, &metadata);
+        }
+        else if (action == EXTRACT && should_print)
+        {
+            // queued files must be complete before an entry of the same name may replace them
+            if (batched)
+            {
+                drain_uring(&uring);
+            }
+            extract_file(reader, parent->fd, name + leaf, file_size, &metadata);
+        }
+        else if (action == COMPARE && should_print && sparse)
+        {
+            differences += !compare_sparse_file(reader, parent, name, leaf, file_size, &sparse_map, &metadata,
+                                                compare_buffer);
+        }
+        else if (action == COMPARE && should_print && (type == HARD_LINK[0] || type == SYMLINK[0]))
+        {
+            differences += !compare_link(directories.root->fd, link, parent, name, leaf, type == SYMLINK[0]);
+            skip_blocks(reader, blocks_count);
+        }
+        else if (action == COMPARE && should_print && type == DIRECTORY[0])
+        {
+            differences += !compare_directory(parent, name, leaf, &metadata);
+            skip_blocks(reader, blocks_count);
+        }
+        else if (action == COMPARE && should_print && regular && parallel)
+        {
+            long data_offset = reader->offset;
+
+            skip_blocks(reader, blocks_count);          // check that data is present in the archive
+            submit_job(&pool, parent, name, leaf, data_offset, file_size, &metadata, output);
+            output = NULL;                          // the worker finishes it
+        }
+        else if (action == COMPARE && should_print && regular)
+        {
+            differences += !compare_file(reader, parent, name, leaf, file_size, &metadata, compare_buffer);
+        }
+        else if (!hashing)                          // hashed data was already read
+        {
+            started = stats_clock();
+            skip_blocks(reader, blocks_count);
+            add_stat(&stats.skipped, file_size);
+            add_time(&stats.skip_time, started);
+        }
+
+        if (output != NULL)
+        {
+            finish_output(&pool, output);
+        }
+        report = NULL;
+
+        blocks_read += blocks_count;
+        members_end = reader->offset;
+        reset_extended(&extended);
+    }
+
+    if (parallel)
+    {
+        finish_pool(&pool);
+        differences += pool.differences;
+    }
+
+    if (batched)
+    {
+        close_uring(&uring);
+    }
+
+    // files in directories are all written now
+    if (action == EXTRACT)
+    {
+        restore_directories(&directories);
+    }
+
+    if (action == EXTRACT || action == COMPARE)
+    {
+        close_directory_cache(&directories);
+    }
+    free(compare_buffer);
+
+    if (indexing)
+    {
+        write_index(&builder, options->index_path, reader->size, reader->mtime);
+    }
+    free_builder(&builder);
+    free(targets);
+    free(sparse_map.regions);
+    free(extended.data);
+
+    // listing comes before warnings about the end of archive
+    long started = stats_clock();
+
+    fflush(stdout);
+    add_time(&stats.print_time, started);
+
+    if (stats.enabled)
+    {
+        print_stats(stats_clock() - archive_started, (long)blocks_read * BLOCK_SIZE);
+    }
+
+    // one empty block triggers a warning
+    if (first_empty && !second_empty)
+    {
+        warnx("A lone zero block at %d", blocks_read);
+    }
+
+    // print files not found in archive
+    if (report_missing_files(&files))
+    {
+        errx(2, "Exiting with failure status due to previous errors");
+    }
+
+    free_file_set(&files);
+
+    // as with diff, exit status tells that the files differ
+    if (differences > 0)
+    {
+        exit(1);
+    }
+    return members_end;
+}
+
+// stores value into numeric header field, in octal when it fits, otherwise in base-256
+void format_number(char *field, int width, long value)
+{
+    if (value >= 0 && value < 1L << (3 * (width - 1)))
+    {
+        snprintf(field, width, "%0*lo", width - 1, value);
+        return;
+    }
+
+    field[0] = value < 0 ? 0xff : 0x80;
+
+    for (int i = width - 1; i > 0; i--)
+    {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+void init_writer(struct Writer *writer, int fd, int blocking_factor)
+{
+    writer->fd = fd;
+    writer->record_size = (long)blocking_factor * BLOCK_SIZE;
+    writer->used = 0;
+    writer->offset = 0;
+
+    if (posix_memalign((void**)&writer->buffer, BUFFER_ALIGNMENT, writer->record_size) != 0)
+    {
+        errx(2, "posix_memalign");
+    }
+}
+
+void flush_writer(struct Writer *writer)
+{
+    write_all(writer->fd, writer->buffer, writer->used);
+    writer->used = 0;
+}
+
+// appends data to the archive, writing every record as soon as it is complete
+void write_data(struct Writer *writer, char *data, long size)
+{
+    while (size > 0)
+    {
+        long chunk = writer->record_size - writer->used;
+
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+
+        memcpy(writer->buffer + writer->used, data, chunk);
+        writer->used += chunk;
+        writer->offset += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (writer->used == writer->record_size)
+        {
+            flush_writer(writer);
+        }
+    }
+}
+
+void write_zeros(struct Writer *writer, long count)
+{
+    static char zeros[BLOCK_SIZE];
+
+    while (count > 0)
+    {
+        long chunk = count < BLOCK_SIZE ? count : BLOCK_SIZE;
+
+        write_data(writer, zeros, chunk);
+        count -= chunk;
+    }
+}
+
+// appends zero bytes after data of given size up to the next multiple of alignment
+void write_padding(struct Writer *writer, long size, long alignment)
+{
+    write_zeros(writer, (alignment - size % alignment) % alignment);
+}
+
+// copies size bytes of a large file to the archive, inside the kernel when possible,
+// returns number of bytes copied, less than size if the file shrank
+long write_file_data(struct Writer *writer, int fd, long size)
+{
+    long left = size;
+
+    flush_writer(writer);
+
+    while (left > 0)
+    {
+        ssize_t copied = copy_file_range(fd, NULL, writer->fd, NULL, left, 0);
+
+        if (copied <= 0)
+        {
+            break;
+        }
+        writer->offset += copied;
+        left -= copied;
+    }
+
+    while (left > 0)
+    {
+        long chunk = left < writer->record_size ? left : writer->record_size;
+        ssize_t bytes = read(fd, writer->buffer, chunk);
+
+        if (bytes <= 0)
+        {
+            break;
+        }
+        writer->used = bytes;
+        writer->offset += bytes;
+        flush_writer(writer);
+        left -= bytes;
+    }
+
+    return size - left;
+}
+
+// checksum field is summed as spaces, stored as six digits, zero and space
+void set_checksum(struct Header *header)
+{
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    snprintf(header->chksum, sizeof(header->chksum), "%06lo", block_sum((char*)header));
+    header->chksum[7] = ' ';
+}
+
+// writes GNU record carrying a name or link target too long for the header that follows it
+void write_long_name(struct Writer *writer, char type, char *text)
+{
+    char block[BLOCK_SIZE];
+    struct Header *header = (struct Header*)block;
+    long size = strlen(text) + 1;
+
+    memset(block, 0, BLOCK_SIZE);
+    memcpy(header->name, LONG_LINK_NAME, strlen(LONG_LINK_NAME));
+    format_number(header->mode, sizeof(header->mode), 0);
+    format_number(header->uid, sizeof(header->uid), 0);
+    format_number(header->gid, sizeof(header->gid), 0);
+    format_number(header->size, sizeof(header->size), size);
+    format_number(header->mtime, sizeof(header->mtime), 0);
+    header->typeflag[0] = type;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    set_checksum(header);
+
+    write_data(writer, block, BLOCK_SIZE);
+    write_data(writer, text, size);
+    write_padding(writer, size, BLOCK_SIZE);
+}
+
+// fills GNU tar header of a file at the start of a whole block, the rest of which is zeroed,
+// names that don't fit are cut there, the long name records before it have them whole
+void fill_header(struct Creator *creator, struct Header *header, struct CreateItem *item)
+{
+    memset(header, 0, BLOCK_SIZE);
+
+    char type = S_ISDIR(item->stx.stx_mode) ? DIRECTORY[0] : S_ISLNK(item->stx.stx_mode) ? SYMLINK[0] : REG_FILE[0];
+
+    memcpy(header->name, item->name, strnlen(item->name, sizeof(header->name) - 1));
+    format_number(header->mode, sizeof(header->mode), item->stx.stx_mode & 07777);
+    format_number(header->uid, sizeof(header->uid), item->stx.stx_uid);
+    format_number(header->gid, sizeof(header->gid), item->stx.stx_gid);
+    format_number(header->size, sizeof(header->size), item->stx.stx_size);
+    format_number(header->mtime, sizeof(header->mtime), item->stx.stx_mtime.tv_sec);
+    header->typeflag[0] = type;
+    memcpy(header->magic, MAGIC, sizeof(MAGIC));
+
+    if (item->link != NULL)
+    {
+        memcpy(header->linkname, item->link, strnlen(item->link, sizeof(header->linkname) - 1));
+    }
+
+    if (item->stx.stx_uid != creator->uid)
+    {
+        struct passwd *pw = getpwuid(item->stx.stx_uid);
+
+        creator->uid = item->stx.stx_uid;
+        snprintf(creator->uname, sizeof(creator->uname), "%s", pw != NULL ? pw->pw_name : "");
+    }
+
+    if (item->stx.stx_gid != creator->gid)
+    {
+        struct group *gr = getgrgid(item->stx.stx_gid);
+
+        creator->gid = item->stx.stx_gid;
+        snprintf(creator->gname, sizeof(creator->gname), "%s", gr != NULL ? gr->gr_name : "");
+    }
+
+    memcpy(header->uname, creator->uname, strlen(creator->uname));
+    memcpy(header->gname, creator->gname, strlen(creator->gname));
+    set_checksum(header);
+}
+
+// hands a file over to the prefetch threads, waits while the ring is full,
+// the item takes ownership of link
+void queue_item(struct Creator *creator, char *path, char *name, char *link, struct statx *stx)
+{
+    pthread_mutex_lock(&creator->lock);
+
+    while (creator->queued - creator->written == CREATE_QUEUE_LENGTH)
+    {
+        pthread_cond_wait(&creator->changed, &creator->lock);
+    }
+
+    struct CreateItem *item = &creator->items[creator->queued % CREATE_QUEUE_LENGTH];
+
+    snprintf(item->path, sizeof(item->path), "%s", path);
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    item->link = link;
+    item->stx = *stx;
+    item->data = NULL;
+    item->fd = -1;
+    item->loaded = false;
+    item->failed = false;
+    creator->queued++;
+
+    pthread_cond_broadcast(&creator->changed);
+    pthread_mutex_unlock(&creator->lock);
+}
+
+void creation_failed(struct Creator *creator)
+{
+    pthread_mutex_lock(&creator->lock);
+    creator->failed = true;
+    pthread_mutex_unlock(&creator->lock);
+}
+
+// adds files under path, directories come before their contents, which are walked recursively,
+// symbolic links are archived as they are, not followed
+void walk_path(struct Creator *creator, char *path)
+{
+    struct statx stx;
+
+    if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) != 0)
+    {
+        warnx("%s: Cannot stat", path);
+        creation_failed(creator);
+        return;
+    }
+
+    if (makedev(stx.stx_dev_major, stx.stx_dev_minor) == creator->archive.st_dev
+        && stx.stx_ino == creator->archive.st_ino)
+    {
+        warnx("%s: file is the archive; not dumped", path);
+        return;
+    }
+
+    if (!S_ISREG(stx.stx_mode) && !S_ISDIR(stx.stx_mode) && !S_ISLNK(stx.stx_mode))
+    {
+        warnx("%s: Unsupported file type; not dumped", path);
+        return;
+    }
+
+    char *name = member_name(path);
+    char directory_name[PATH_MAX + 2];
+
+    if (name != path && !creator->stripped)
+    {
+        warnx("Removing leading `/' from member names");
+        creator->stripped = true;
+    }
+
+    if (S_ISDIR(stx.stx_mode) && (*name == '\0' || name[strlen(name) - 1] != '/'))
+    {
+        snprintf(directory_name, sizeof(directory_name), "%s/", *name != '\0' ? name : ".");
+        name = directory_name;
+    }
+
+    // with -u, files are only added when they are newer than their copy in the archive,
+    // contents of an older directory may still be
+    bool added = creator->update == NULL || creator->update->members == NULL
+                 || member_mtime(creator->update->members, name) < stx.stx_mtime.tv_sec;
+
+    if (added && S_ISLNK(stx.stx_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+
+        if (length < 0)
+        {
+            warnx("%s: Cannot readlink", path);
+            creation_failed(creator);
+            return;
+        }
+        target[length] = '\0';
+
+        char *link = strdup(target);
+
+        if (link == NULL)
+        {
+            errx(2, "strdup");
+        }
+
+        stx.stx_size = 0;
+        queue_item(creator, path, name, link, &stx);
+        return;
+    }
+
+    if (added)
+    {
+        stx.stx_size = S_ISREG(stx.stx_mode) ? stx.stx_size : 0;
+        queue_item(creator, path, name, NULL, &stx);
+    }
+
+    if (!S_ISDIR(stx.stx_mode))
+    {
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    struct dirent *dirent;
+
+    if (dir == NULL)
+    {
+        warnx("%s: Cannot open directory", path);
+        creation_failed(creator);
+        return;
+    }
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        char child[PATH_MAX];
+        bool slash = path[strlen(path) - 1] == '/';
+
+        if (snprintf(child, sizeof(child), "%s%s%s", path, slash ? "" : "/", dirent->d_name) >= (int)sizeof(child))
+        {
+            warnx("%s/%s: file name is too long; not dumped", path, dirent->d_name);
+            creation_failed(creator);
+            continue;
+        }
+        walk_path(creator, child);
+    }
+
+    closedir(dir);
+}
+
+void *traverse_main(void *arg)
+{
+    struct Creator *creator = arg;
+
+    for (int i = 0; i < creator->paths_count; i++)
+    {
+        walk_path(creator, creator->paths[i]);
+    }
+
+    pthread_mutex_lock(&creator->lock);
+    creator->traversed = true;
+    pthread_cond_broadcast(&creator->changed);
+    pthread_mutex_unlock(&creator->lock);
+    return NULL;
+}
+
+// opens file for the writer, small files are read whole into memory
+void prefetch_item(struct CreateItem *item)
+{
+    long size = item->stx.stx_size;
+
+    // directories and links have nothing to read
+    if (!S_ISREG(item->stx.stx_mode))
+    {
+        return;
+    }
+
+    item->fd = open(item->path, O_RDONLY);
+
+    if (item->fd < 0)
+    {
+        warnx("%s: Cannot open", item->path);
+        item->failed = true;
+        return;
+    }
+
+    if (size > PREFETCH_LIMIT)
+    {
+        return;
+    }
+
+    item->data = malloc(size > 0 ? size : 1);
+
+    if (item->data == NULL)
+    {
+        errx(2, "malloc");
+    }
+
+    long loaded = 0;
+
+    while (loaded < size)
+    {
+        ssize_t bytes = read(item->fd, item->data + loaded, size - loaded);
+
+        if (bytes <= 0)
+        {
+            break;
+        }
+        loaded += bytes;
+    }
+
+    if (loaded < size)
+    {
+        warnx("%s: File shrank by %ld bytes; padding with zeros", item->path, size - loaded);
+        memset(item->data + loaded, 0, size - loaded);
+    }
+
+    close(item->fd);
+    item->fd = -1;
+}
+
+void *prefetch_main(void *arg)
+{
+    struct Creator *creator = arg;
+
+    pthread_mutex_lock(&creator->lock);
+
+    while (true)
+    {
+        while (creator->loading == creator->queued && !creator->traversed)
+        {
+            pthread_cond_wait(&creator->changed, &creator->lock);
+        }
+
+        if (creator->loading == creator->queued)
+        {
+            break;
+        }
+
+        struct CreateItem *item = &creator->items[creator->loading++ % CREATE_QUEUE_LENGTH];
+
+        pthread_mutex_unlock(&creator->lock);
+        prefetch_item(item);
+        pthread_mutex_lock(&creator->lock);
+
+        item->loaded = true;
+        if (item->failed)
+        {
+            creator->failed = true;
+        }
+        pthread_cond_broadcast(&creator->changed);
+    }
+
+    pthread_mutex_unlock(&creator->lock);
+    return NULL;
+}
+
+// writes header and data of a prefetched item
+void write_item(struct Creator *creator, struct Writer *writer, struct CreateItem *item)
+{
+    char block[BLOCK_SIZE];
+    struct Header *header = (struct Header*)block;
+    long size = item->stx.stx_size;
+
+    if (creator->update != NULL && creator->update->added != NULL)
+    {
+        add_to_index(creator->update->added, item->name, writer->offset, size, item->stx.stx_mtime.tv_sec, 0);
+    }
+
+    if (strlen(item->name) >= sizeof(header->name))
+    {
+        write_long_name(writer, LONG_NAME[0], item->name);
+    }
+    if (item->link != NULL && strlen(item->link) >= sizeof(header->linkname))
+    {
+        write_long_name(writer, LONG_LINK[0], item->link);
+    }
+
+    fill_header(creator, header, item);
+    write_data(writer, block, BLOCK_SIZE);
+
+    if (item->data != NULL)
+    {
+        write_data(writer, item->data, size);
+        free(item->data);
+    }
+    else if (item->fd >= 0)
+    {
+        long copied = write_file_data(writer, item->fd, size);
+
+        close(item->fd);
+
+        // the header is already out, so the member must keep its size
+        if (copied < size)
+        {
+            warnx("%s: File shrank by %ld bytes; padding with zeros", item->path, size - copied);
+            write_zeros(writer, size - copied);
+            write_padding(writer, size, BLOCK_SIZE);
+            return;
+        }
+    }
+
+    write_padding(writer, size, BLOCK_SIZE);
+}
+
+// creates archive from given files and directories
+// returns true if some of them couldn't be archived
+// with update given, members are written over the end-of-archive blocks of an existing archive
+bool create_archive(char *filename, char **paths, int paths_count, struct Options *options, int blocking_factor,
+                    struct Update *update)
+{
+    struct Creator *creator = calloc(1, sizeof(struct Creator));
+    struct Writer writer;
+    pthread_t traversal;
+    pthread_t *prefetchers = calloc(options->jobs, sizeof(pthread_t));
+
+    if (creator == NULL || prefetchers == NULL)
+    {
+        errx(2, "calloc");
+    }
+
+    int fd = strcmp(filename, "-") == 0 ? STDOUT_FILENO
+             : open(filename, update != NULL ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    // names go to stderr when the archive itself is written to stdout
+    FILE *listing = fd == STDOUT_FILENO ? stderr : stdout;
+
+    if (fd < 0 || fstat(fd, &creator->archive) != 0)
+    {
+        errx(2, "Error creating archive");
+    }
+
+    if (update != NULL && lseek(fd, update->end, SEEK_SET) != update->end)
+    {
+        errx(2, "Error seeking archive");
+    }
+
+    pthread_mutex_init(&creator->lock, NULL);
+    pthread_cond_init(&creator->changed, NULL);
+    creator->paths = paths;
+    creator->paths_count = paths_count;
+    creator->uid = (uid_t)-1;
+    creator->gid = (gid_t)-1;
+    creator->update = update;
+
+    init_writer(&writer, fd, blocking_factor);
+
+    if (update != NULL)
+    {
+        writer.offset = update->end;
+    }
+
+    if (pthread_create(&traversal, NULL, traverse_main, creator) != 0)
+    {
+        errx(2, "pthread_create");
+    }
+
+    for (int i = 0; i < options->jobs; i++)
+    {
+        if (pthread_create(&prefetchers[i], NULL, prefetch_main, creator) != 0)
+        {
+            errx(2, "pthread_create");
+        }
+    }
+
+    pthread_mutex_lock(&creator->lock);
+
+    while (true)
+    {
+        struct CreateItem *item = &creator->items[creator->written % CREATE_QUEUE_LENGTH];
+
+        // wait for the oldest item to be prefetched or for the end of traversal
+        while (creator->written < creator->queued ? !item->loaded : !creator->traversed)
+        {
+            pthread_cond_wait(&creator->changed, &creator->lock);
+        }
+
+        if (creator->written == creator->queued)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&creator->lock);
+
+        if (!item->failed)
+        {
+            if (options->verbose)
+            {
+                fprintf(listing, "%s\n", item->name);
+            }
+            write_item(creator, &writer, item);
+        }
+        free(item->link);
+
+        pthread_mutex_lock(&creator->lock);
+        creator->written++;
+        pthread_cond_broadcast(&creator->changed);
+    }
+
+    pthread_mutex_unlock(&creator->lock);
+
+    pthread_join(traversal, NULL);
+
+    for (int i = 0; i < options->jobs; i++)
+    {
+        pthread_join(prefetchers[i], NULL);
+    }
+
+    // end of archive, padded to a whole record
+    write_zeros(&writer, END_BLOCKS * BLOCK_SIZE);
+    write_padding(&writer, writer.offset, MIN_RECORD_SIZE);
+    flush_writer(&writer);
+
+    // the old archive may have been padded further than the new one is
+    if (update != NULL && ftruncate(fd, writer.offset) != 0)
+    {
+        errx(2, "Error writing archive");
+    }
+
+    if (close(fd) != 0)
+    {
+        errx(2, "Error writing archive");
+    }
+
+    bool failed = creator->failed;
+
+    pthread_mutex_destroy(&creator->lock);
+    pthread_cond_destroy(&creator->changed);
+    free(writer.buffer);
+    free(prefetchers);
+    free(creator);
+    return failed;
+}
+
+// end of an archive from its fresh index, headers after the last indexed member are followed
+// in the mapping, members of the index are collected as well,
+// -1 if the headers don't end with a zero block or at the end of the archive
+long indexed_end(struct Reader *reader, struct Index *index, struct IndexBuilder *members)
+{
+    long count = index->header->entries_count;
+    long offset = count > 0 ? index->entries[count - 1].offset : 0;
+    long pax_size = -1;
+    long next;
+
+    for (long i = 0; i < count; i++)
+    {
+        struct IndexEntry *entry = &index->entries[i];
+
+        if (entry->name >= index->names_size)
+        {
+            return -1;
+        }
+        add_to_index(members, index->names + entry->name, entry->offset, entry->size, entry->mtime, entry->hash);
+    }
+
+    if (offset < 0 || offset > reader->size)
+    {
+        return -1;
+    }
+
+    while ((next = next_header(reader, offset, &pax_size)) >= 0)
+    {
+        offset = next;
+    }
+
+    if (offset < reader->size && (offset > reader->size - BLOCK_SIZE || block_sum(reader->map + offset) != 0))
+    {
+        return -1;
+    }
+
+    return offset;
+}
+
+// adds files at the end of an existing archive, with -u only those newer than their last copy in it
+// the end is found through the index sidecar when it is fresh, otherwise the whole archive is read,
+// with index requested, the sidecar is then rewritten to cover the new members too
+bool append_archive(char *filename, char **paths, int paths_count, struct Options *options, int blocking_factor)
+{
+    FILE *fin = fopen(filename, "r");
+
+    // missing archive is created, as tar does
+    if (fin == NULL && errno == ENOENT)
+    {
+        return create_archive(filename, paths, paths_count, options, blocking_factor, NULL);
+    }
+
+    if (fin == NULL)
+    {
+        errx(2, "Error opening file");
+    }
+
+    struct Reader reader;
+    struct Index index;
+    struct IndexBuilder members;
+    struct IndexBuilder added;
+    struct Update update = { .end = -1, .members = NULL, .added = NULL };
+
+    open_reader(&reader, fileno(fin), NULL, blocking_factor);
+
+    // end of a compressed stream can't be overwritten in place
+    if (!reader.mapped)
+    {
+        errx(2, "Cannot update compressed archives");
+    }
+
+    init_builder(&members);
+    init_builder(&added);
+
+    if (options->index_path != NULL && open_index(&index, options->index_path, &reader))
+    {
+        update.end = indexed_end(&reader, &index, &members);
+        close_index(&index);
+    }
+
+    if (update.end < 0)
+    {
+        struct Options scan = *options;             // members are only collected, the index is written later
+
+        scan.index_path = NULL;
+        free_builder(&members);
+        init_builder(&members);
+        update.end = read_archive(&reader, NULL, 0, &scan, &members);
+    }
+
+    close_reader(&reader);
+    fclose(fin);
+
+    struct IndexHeader header;
+    struct Index view;
+
+    if (options->action == UPDATE)
+    {
+        view_builder(&members, &view, &header);
+        update.members = &view;
+    }
+
+    if (options->index_path != NULL)
+    {
+        update.added = &added;
+    }
+
+    bool failed = create_archive(filename, paths, paths_count, options, blocking_factor, &update);
+    struct stat st;
+
+    if (options->index_path != NULL && stat(filename, &st) == 0)
+    {
+        for (long i = 0; i < added.entries_count; i++)
+        {
+            struct IndexEntry *entry = &added.entries[i];
+
+            add_to_index(&members, added.names + entry->name, entry->offset, entry->size, entry->mtime, entry->hash);
+        }
+        write_index(&members, options->index_path, st.st_size, st.st_mtime);
     }
-}
 
-// only regular files are supported
-void is_regular_file(struct Header *header)
-{
-    if (strcmp(header->typeflag, REG_FILE) != 0)
+    if (update.members != NULL)
     {
-        errx(2, "Unsupported header type: %d", header->typeflag[0]);
+        free(view.buckets);
     }
+    free_builder(&members);
+    free_builder(&added);
+    return failed;
 }
 
-// if filename appears among arguments to be listed, mark the file as found (1)
-// and return true (so that filename will be printed)
-bool mark_file(char *filename, char **files_args, int files_count, bool *files_found)
+// parses numeric option argument in range 1 to max
+int parse_count(char *arg, long max, char *description)
 {
-    for (int i = 0; i < files_count; i++)
+    char *end;
+    long count = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || count < 1 || count > max)
     {
-        if (!files_found[i] && strcmp(filename, files_args[i]) == 0)
-        {
-            files_found[i] = true;
-            return true;
-        }
+        errx(2, "%s: Invalid %s", arg, description);
     }
-    return false;
+    return count;
 }
 
-// reports files that were not found in the archive
-// returns true if any of specified files was NOT present in archive
-bool report_missing_files(char **files_args, int files_count, bool *files_found)
+// parses a number of bytes, optionally followed by K, M or G
+long parse_size(char *arg, long min, char *description)
 {
-    bool was_found = false;
+    char *end;
+    long size = strtol(arg, &end, 10);
+    int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
 
-    for (int i = 0; i < files_count; i++)
+    if (shift > 0)
     {
-        if (!files_found[i])
-        {
-            warnx("%s: Not found in archive", files_args[i]);
-            was_found = true;
-        }
+        end++;
+    }
+
+    if (*arg == '\0' || *end != '\0' || size < 1 || size > (LONG_MAX >> shift) || (size << shift) < min)
+    {
+        errx(2, "%s: Invalid %s", arg, description);
     }
-    return was_found;
+    return size << shift;
 }
 
-void extract_file(FILE *fin, char *buffer)
+// adds an -f argument to volumes of the archive, a pattern which is not an existing file
+// is expanded, volumes are then taken in the sorted order of names
+void add_volumes(char ***names, int *count, char *arg)
 {
-    struct Header *header = (struct Header*)buffer;
-    FILE *fout = fopen(header->name, "w");
+    glob_t matches;
+    struct stat st;
+    bool expanded = stat(arg, &st) != 0 && strpbrk(arg, "*?[") != NULL
+                    && glob(arg, 0, NULL, &matches) == 0;
+    size_t added = expanded ? matches.gl_pathc : 1;
 
-    if (fout == NULL)
+    *names = realloc(*names, (*count + added) * sizeof(char*));
+
+    if (*names == NULL)
     {
-        errx(2, "Error creating file");
+        errx(2, "realloc");
     }
 
-    long file_size = oct2dec(header->size);                             // size of file in the current entry
-    long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;      // number of blocks containing file data
-    long bytes_left = file_size - (blocks_count - 1) * BLOCK_SIZE;      // data bytes remaning in the last block
-
-    // read and write each data block except the last one
-    // last block may be padded with zeros
-    // we need to write only remaining data bytes from the last block
-    for (int i = 0; i < blocks_count; i++)
+    for (size_t i = 0; i < added; i++)
     {
-        // whole block was read successfully
-        if (fread(buffer, BLOCK_SIZE, 1, fin) == 1)
-        {
-            // last block
-            if (i + 1 == blocks_count)
-            {
-                fwrite(buffer, bytes_left, 1, fout);
-            }
-            else
-            {
-                fwrite(buffer, BLOCK_SIZE, 1, fout);
-            }
-        }
-        else
-        {
-            warnx("Unexpected EOF in archive");
-            errx(2, "Error is not recoverable: exiting now");
-        }
+        (*names)[(*count)++] = strdup(expanded ? matches.gl_pathv[i] : arg);
     }
 
-    fclose(fout);
+    if (expanded)
+    {
+        globfree(&matches);
+    }
 }
 
-// reads whole archive and compare every filename with arguments
-// prints filenames and extracts files if needed
-void read_archive(FILE *fin, long archive_size, char **files_args, int files_count, enum mode action, bool verbose)
+// moves past the unread data of the current library entry and its padding
+void skip_entry(struct mytar *archive)
 {
-    char buffer[BLOCK_SIZE] = { 0 };
-    bool first_empty = false;                   // first zero block encountered
-    bool second_empty = false;                  // second zero block encountered
-    int blocks_read = 0;                        // number of blocks read so far
+    struct Reader *reader = &archive->reader;
+    long padding = (BLOCK_SIZE - archive->data_size % BLOCK_SIZE) % BLOCK_SIZE;
 
-    // used for evidence which files were found in the archive
-    bool *files_found = calloc(files_count, sizeof(bool));
+    seek_reader(reader, reader->offset + archive->data_left + padding);
+    archive->data_size = 0;
+    archive->data_left = 0;
+}
 
-    if (files_found == NULL)
-    {
-        errx(2, "calloc");
-    }
+// reads headers up to the next member as read_archive does, returns 0 at the end of archive
+int next_entry(struct mytar *archive, struct mytar_entry *entry)
+{
+    struct Reader *reader = &archive->reader;
+    struct Extended *extended = &archive->extended;
 
-    // while block of 512 bytes is successfully read
-    while (fread(&buffer, BLOCK_SIZE, 1,  fin) == 1)
+    skip_entry(archive);
+    reset_extended(extended);
+
+    while (!archive->ended)
     {
-        blocks_read++;
+        long header_offset = reader->offset;
+        char *buffer = read_block(reader);
 
-        if (is_empty_block(buffer))
+        if (buffer == NULL)
         {
-            if (!first_empty)
-            {
-                first_empty = true;
-                continue;
-            }
-            else
-            {
-                second_empty = true;            // two consecutive empty blocks signalize the end of archive
-                break;
-            }
+            archive->ended = true;
+            break;
         }
 
-        struct Header *header = (struct Header*)&buffer;
-        long file_size = oct2dec(header->size);                          // size of file in the current entry
-        long blocks_count = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;   // number of blocks with contents of file, rounded up
+        unsigned long sum = block_sum(buffer);
 
-        is_tar_archive(header);                 // check magic field in header
-        is_regular_file(header);                // check typeflag field in header
+        // two consecutive empty blocks signalize the end of archive
+        if (sum == 0)
+        {
+            archive->ended = archive->first_empty;
+            archive->first_empty = true;
+            continue;
+        }
 
-        // filename was found among arguments
-        bool filename_found = mark_file(header->name, files_args, files_count, files_found);
-        
-        // if there are no arguments or filename was among them, it may be printed
-        bool should_print = (files_count == 0 || filename_found) ? true : false;
+        struct Header *header = (struct Header*)buffer;
 
-        // when in listing mode, print filename
-        // when in extraction mode, print filename if verbose flag is also set 
-        if (should_print && (action == LIST || (action == EXTRACT && verbose)))
+        is_tar_archive(header);
+        check_header(header, sum, header_offset);
+
+        if (is_extended_header(header))
         {
-            printf("%s\n", header->name);
+            read_extended_header(reader, header, extended, header_offset);
+            continue;
         }
 
-        fflush(stdout);
+        // data read by the caller refills the record buffer
+        archive->header = *header;
+        header = &archive->header;
+        archive->data_size = extended->size >= 0 ? extended->size : member_size(header);
+        archive->data_left = archive->data_size;
 
-        // when in extraction mode, extract file from current entry
-        // else advance to the next file header
-        if (action == EXTRACT && should_print)
+        entry->real_size = archive->data_size;
+
+        if (header->typeflag[0] == SPARSE_FILE[0])
         {
-            extract_file(fin, buffer);
+            read_sparse_map(reader, header, &archive->sparse_map);
+            entry->real_size = archive->sparse_map.real_size;
         }
-        else
+
+        entry->name = entry_name(header, extended, archive->name_buffer);
+        entry->link = entry_link(header, extended, archive->link_buffer);
+        entry->type = header->typeflag[0];
+        entry->size = archive->data_size;
+        entry->mode = parse_number(header->mode, sizeof(header->mode));
+        entry->uid = extended->uid >= 0 ? extended->uid : parse_number(header->uid, sizeof(header->uid));
+        entry->gid = extended->gid >= 0 ? extended->gid : parse_number(header->gid, sizeof(header->gid));
+        entry->mtime = entry_mtime(header, extended);
+        entry->offset = extended->offset >= 0 ? extended->offset : header_offset;
+        return 1;
+    }
+
+    return 0;
+}
+
+// copies the next part of the current library entry's data, padding is left for skip_entry
+long read_entry(struct mytar *archive, char *buffer, long size)
+{
+    struct Reader *reader = &archive->reader;
+    long count = size < archive->data_left ? size : archive->data_left;
+    long copied = 0;
+
+    if (reader->mapped)
+    {
+        if (count > reader->size - reader->offset)
         {
-            fseek(fin, BLOCK_SIZE * blocks_count, SEEK_CUR);
+            unexpected_eof();
         }
+        memcpy(buffer, reader->map + reader->offset, count);
+        reader->offset += count;
+        copied = count;
+    }
+
+    while (copied < count)
+    {
+        long taken;
+        char *data = take_bytes(reader, count - copied, &taken);
 
-        // if fseek got beyond the end of file, report an error
-        if (ftell(fin) > archive_size)
+        if (taken == 0)
         {
-            warnx("Unexpected EOF in archive");
-            errx(2, "Error is not recoverable: exiting now");
+            unexpected_eof();
         }
+        memcpy(buffer + copied, data, taken);
+        copied += taken;
+    }
 
-        blocks_read += blocks_count;
+    archive->data_left -= count;
+    return count;
+}
+
+// ends a library call that caught an error, the archive can only be closed after it
+int trapped(struct mytar *archive)
+{
+    trap = NULL;
+    archive->failed = true;
+    return -1;
+}
+
+// opens reader of a library archive, returns false if it failed
+bool open_archive(struct mytar *archive, int fd)
+{
+    if (setjmp(archive->trap.jump) != 0)
+    {
+        trap = NULL;
+        return false;
     }
 
-    // one empty block triggers a warning
-    if (first_empty && !second_empty)
+    trap = &archive->trap;
+    open_reader(&archive->reader, fd, NULL, DEFAULT_BLOCKING_FACTOR);
+    trap = NULL;
+
+    return true;
+}
+
+EXPORT struct mytar *mytar_open(int fd, char *error, size_t error_size)
+{
+    struct mytar *archive = calloc(1, sizeof(struct mytar));
+
+    if (archive == NULL)
     {
-        warnx("A lone zero block at %d", blocks_read);
+        snprintf(error, error_size, "Cannot allocate memory");
+        return NULL;
     }
 
-    // print files not found in archive
-    if (report_missing_files(files_args, files_count, files_found))
+    // reader's fields are set before anything can fail, so it can be closed
+    if (!open_archive(archive, fd))
     {
-        errx(2, "Exiting with failure status due to previous errors");
+        snprintf(error, error_size, "%s", archive->trap.message);
+        close_reader(&archive->reader);
+        free(archive);
+        return NULL;
+    }
+
+    reset_extended(&archive->extended);
+    return archive;
+}
+
+EXPORT int mytar_next(struct mytar *archive, struct mytar_entry *entry)
+{
+    if (archive->failed)
+    {
+        return -1;
+    }
+    if (setjmp(archive->trap.jump) != 0)
+    {
+        return trapped(archive);
+    }
+
+    trap = &archive->trap;
+    int result = next_entry(archive, entry);
+    trap = NULL;
+
+    return result;
+}
+
+EXPORT ssize_t mytar_read(struct mytar *archive, void *buffer, size_t size)
+{
+    if (archive->failed)
+    {
+        return -1;
+    }
+    if (setjmp(archive->trap.jump) != 0)
+    {
+        return trapped(archive);
+    }
+
+    trap = &archive->trap;
+    long count = read_entry(archive, buffer, size < LONG_MAX ? (long)size : LONG_MAX);
+    trap = NULL;
+
+    return count;
+}
+
+EXPORT int mytar_skip(struct mytar *archive)
+{
+    if (archive->failed)
+    {
+        return -1;
     }
+    if (setjmp(archive->trap.jump) != 0)
+    {
+        return trapped(archive);
+    }
+
+    trap = &archive->trap;
+    skip_entry(archive);
+    trap = NULL;
+
+    return 0;
+}
+
+EXPORT const char *mytar_error(struct mytar *archive)
+{
+    return archive->failed ? archive->trap.message : "";
+}
 
-    free(files_args);
-    free(files_found);
+EXPORT void mytar_close(struct mytar *archive)
+{
+    close_reader(&archive->reader);
+    free(archive->extended.data);
+    free(archive->sparse_map.regions);
+    free(archive);
 }
 
+// the library is built without the command
+#ifndef MYTAR_LIBRARY
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
-        errx(2, "You must specify one of the '-tx' options");
+        errx(2, "You must specify one of the '-ctxrud' options");
     }
 
     FILE *fin;
     
     bool fflag = false;
+    bool cflag = false;
     bool tflag = false;
     bool xflag = false;
+    bool rflag = false;
+    bool uflag = false;
+    bool dflag = false;
     bool vflag = false;
+
+    int blocking_factor = DEFAULT_BLOCKING_FACTOR;          // archive is read in records of this many blocks
+    int jobs = 1;                                           // number of threads writing extracted files
+    bool index_flag = false;                                // use or build index sidecar of the archive
+    bool occurrence_flag = false;                           // stop after all files were found
+    bool skip_checksum_flag = false;                        // trust the archive, don't verify headers
+    bool uring_flag = false;                                // extract small files through io_uring
+    enum listing listing = PLAIN;                           // format of listed members
+    bool wildcards_flag = false;                            // file arguments are patterns
+    bool hash_flag = false;                                 // list members with hashes of their data
     
     int files_count = 0;                                    // number of file arguments
 
-    char *filename;                                         // archive name
+    char *filename = NULL;                                  // archive name
+    char *directory = NULL;                                 // -C, where files are extracted
+    char **volume_names = NULL;                             // parts of a split archive, in order
+    int volumes_count = 0;
     char **files_args = malloc(sizeof(char*) * argc);       // files to be listed/extracted, supplied as arguments
 
     if (files_args == NULL)
@@ -296,7 +6690,32 @@ int main(int argc, char **argv)
                     {
                         errx(2, "Option requires an argument -- 'f'");
                     }
-                    filename = argv[++i];
+                    add_volumes(&volume_names, &volumes_count, argv[++i]);
+                    filename = volume_names[0];
+                    break;
+                case 'b':
+                    if (i + 1 == argc)
+                    {
+                        errx(2, "Option requires an argument -- 'b'");
+                    }
+                    blocking_factor = parse_count(argv[++i], MAX_BLOCKING_FACTOR, "blocking factor");
+                    break;
+                case 'C':
+                    if (i + 1 == argc)
+                    {
+                        errx(2, "Option requires an argument -- 'C'");
+                    }
+                    directory = argv[++i];
+                    break;
+                case 'j':
+                    if (i + 1 == argc)
+                    {
+                        errx(2, "Option requires an argument -- 'j'");
+                    }
+                    jobs = parse_count(argv[++i], MAX_JOBS, "number of jobs");
+                    break;
+                case 'c':
+                    cflag = true;
                     break;
                 case 't':
                     tflag = true;
@@ -304,14 +6723,90 @@ int main(int argc, char **argv)
                 case 'x':
                     xflag = true;
                     break;
+                case 'r':
+                    rflag = true;
+                    break;
+                case 'u':
+                    uflag = true;
+                    break;
+                case 'd':
+                    dflag = true;
+                    break;
                 case 'v':
                     vflag = true;
                     break;
+                case '-':
+                    if (strcmp(argv[i], "--index") == 0)
+                    {
+                        index_flag = true;
+                    }
+                    else if (strcmp(argv[i], "--compare") == 0 || strcmp(argv[i], "--diff") == 0)
+                    {
+                        dflag = true;
+                    }
+                    else if (strcmp(argv[i], "--occurrence") == 0)
+                    {
+                        occurrence_flag = true;
+                    }
+                    else if (strcmp(argv[i], "--skip-checksum") == 0)
+                    {
+                        skip_checksum_flag = true;
+                    }
+                    else if (strcmp(argv[i], "--io-uring") == 0)
+                    {
+                        uring_flag = true;
+                    }
+                    else if (strcmp(argv[i], "--json") == 0)
+                    {
+                        listing = JSON_LINES;
+                    }
+                    else if (strcmp(argv[i], "--print0") == 0)
+                    {
+                        listing = NUL_DELIMITED;
+                    }
+                    else if (strcmp(argv[i], "--wildcards") == 0)
+                    {
+                        wildcards_flag = true;
+                    }
+                    else if (strcmp(argv[i], "--stats") == 0)
+                    {
+                        stats.enabled = true;
+                    }
+                    else if (strcmp(argv[i], "--hash") == 0)
+                    {
+                        hash_flag = true;
+                    }
+                    else if (i + 1 == argc && (strcmp(argv[i], "--max-memory") == 0 || strcmp(argv[i], "--rate") == 0
+                                               || strcmp(argv[i], "--iops") == 0 || strcmp(argv[i], "--max-open") == 0))
+                    {
+                        errx(2, "Option '%s' requires an argument", argv[i]);
+                    }
+                    else if (strcmp(argv[i], "--max-memory") == 0)
+                    {
+                        limits.memory = parse_size(argv[++i], READER_RECORDS * BLOCK_SIZE, "memory limit");
+                    }
+                    else if (strcmp(argv[i], "--rate") == 0)
+                    {
+                        limits.rate = parse_count(argv[++i], MAX_RATE, "rate") * 1000000L;
+                    }
+                    else if (strcmp(argv[i], "--iops") == 0)
+                    {
+                        limits.iops = parse_count(argv[++i], MAX_IOPS, "number of operations per second");
+                    }
+                    else if (strcmp(argv[i], "--max-open") == 0)
+                    {
+                        limits.open_files = parse_count(argv[++i], MAX_OPEN_FILES, "number of open files");
+                    }
+                    else
+                    {
+                        errx(2, "Unknown option");
+                    }
+                    break;
                 default:
                     errx(2, "Unknown option");
             }
         }
-        else if (tflag || xflag)
+        else if (cflag || tflag || xflag || rflag || uflag || dflag)
         {
             files_args[files_count++] = argv[i];
         }
@@ -323,20 +6818,163 @@ int main(int argc, char **argv)
         errx(2, "Error is not recoverable: exiting now");
     }
 
-    if (tflag + xflag != 1)
+    if (cflag + tflag + xflag + rflag + uflag + dflag != 1)
+    {
+        errx(2, "You must specify one of the -c, -t, -x, -r, -u or -d options");
+    }
+
+    struct Options options = { 0 };
+    bool standard = strcmp(filename, "-") == 0;             // archive is stdin or stdout
+
+    options.action = cflag ? CREATE : tflag ? LIST : xflag ? EXTRACT : rflag ? APPEND : uflag ? UPDATE : COMPARE;
+    options.verbose = vflag;
+    options.jobs = jobs;
+    options.occurrence = occurrence_flag;
+    options.verify_checksum = !skip_checksum_flag;
+    options.uring = uring_flag;
+    options.listing = listing;
+    options.wildcards = wildcards_flag;
+    options.directory = directory;
+    options.hash = hash_flag;
+
+    // only a listing reads data of members which are not extracted
+    if (hash_flag && options.action != LIST)
+    {
+        errx(2, "Option --hash is only supported with -t");
+    }
+
+    // sidecar lives next to the archive, there is none for stdin or for volumes
+    if (index_flag && !standard && volumes_count == 1)
+    {
+        options.index_path = malloc(strlen(filename) + sizeof(INDEX_SUFFIX));
+
+        if (options.index_path == NULL)
+        {
+            errx(2, "malloc");
+        }
+        sprintf(options.index_path, "%s%s", filename, INDEX_SUFFIX);
+    }
+
+    bool writing = options.action == CREATE || options.action == APPEND || options.action == UPDATE;
+
+    // names of files to be archived stay relative to the current directory
+    if (directory != NULL && writing)
+    {
+        errx(2, "Option -C is only supported with -x and -d");
+    }
+
+    if (volumes_count > 1 && (writing || standard))
+    {
+        errx(2, "Only an existing archive can be read from several volumes");
+    }
+
+    if (options.action == APPEND || options.action == UPDATE)
+    {
+        if (standard)
+        {
+            errx(2, "Options '-ru' are incompatible with '-f -'");
+        }
+
+        if (files_count == 0)
+        {
+            errx(2, "Cowardly refusing to append nothing to the archive");
+        }
+
+        bool failed = append_archive(filename, files_args, files_count, &options, blocking_factor);
+
+        free(files_args);
+        free(options.index_path);
+
+        if (failed)
+        {
+            errx(2, "Exiting with failure status due to previous errors");
+        }
+        return 0;
+    }
+
+    if (options.action == CREATE)
+    {
+        if (files_count == 0)
+        {
+            errx(2, "Cowardly refusing to create an empty archive");
+        }
+
+        if (standard && isatty(STDOUT_FILENO))
+        {
+            warnx("Refusing to write archive contents to terminal");
+            errx(2, "Error is not recoverable: exiting now");
+        }
+
+        bool failed = create_archive(filename, files_args, files_count, &options, blocking_factor, NULL);
+
+        free(files_args);
+        free(options.index_path);
+
+        if (failed)
+        {
+            errx(2, "Exiting with failure status due to previous errors");
+        }
+        return 0;
+    }
+
+    if (standard && isatty(STDIN_FILENO))
     {
-        errx(2, "You must specify either -t  or -x option");    
+        warnx("Refusing to read archive contents from terminal");
+        errx(2, "Error is not recoverable: exiting now");
     }
 
-    if ((fin = fopen(filename, "r")) == NULL)
+    struct Volumes volumes;
+
+    if (volumes_count > 1)
+    {
+        fin = NULL;
+        open_volumes(&volumes, volume_names, volumes_count);
+    }
+    else if ((fin = standard ? stdin : fopen(filename, "r")) == NULL)
     {
         errx(2, "Error opening file");
     }
 
-    enum mode action = tflag ? LIST : EXTRACT;
+    // listing of a big archive would otherwise be written in a few KiB at a time,
+    // a terminal stays line buffered so that progress is seen
+    static char output_buffer[OUTPUT_BUFFER_SIZE];
+
+    if (!isatty(STDOUT_FILENO))
+    {
+        setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+    }
+
+    struct Reader reader;
 
-    long archive_size = get_archive_size(fin);
-    read_archive(fin, archive_size, files_args, files_count, action, vflag);
+    // record buffer and the decompressor's chunks and input are all of the record size,
+    // they get what is left of --max-memory after prefetched volumes and matching tables
+    long buffers = limits.memory - (volumes_count > 1 ? limits.memory / MEMORY_SHARE : 0)
+                   - (files_count > 0 ? limits.memory / MEMORY_SHARE : 0);
 
-    fclose(fin);
+    if (limits.memory > 0 && blocking_factor > buffers / (READER_RECORDS * BLOCK_SIZE))
+    {
+        blocking_factor = buffers / (READER_RECORDS * BLOCK_SIZE) > 0 ? buffers / (READER_RECORDS * BLOCK_SIZE) : 1;
+    }
+
+    open_reader(&reader, fin != NULL ? fileno(fin) : -1, volumes_count > 1 ? &volumes : NULL, blocking_factor);
+    read_archive(&reader, files_args, files_count, &options, NULL);
+    close_reader(&reader);
+
+    free(options.index_path);
+
+    if (fin != NULL)
+    {
+        fclose(fin);
+    }
+    else
+    {
+        close_volumes(&volumes);
+    }
+
+    for (int i = 0; i < volumes_count; i++)
+    {
+        free(volume_names[i]);
+    }
+    free(volume_names);
 }
+#endif
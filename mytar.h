@@ -0,0 +1,49 @@
+// libmytar, reading tar archives member by member
+// build: cc -O2 -pthread -fPIC -shared -fvisibility=hidden -DMYTAR_LIBRARY -o libmytar.so mytar.c -lz -lzstd
+#ifndef MYTAR_H
+#define MYTAR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// opened archive, one thread at a time may use it, different archives may be read in parallel
+struct mytar;
+
+// member of the archive, strings stay valid until the next mytar_next or mytar_close
+struct mytar_entry
+{
+    const char *name;
+    const char *link;               // target of hard and symbolic links, empty for other members
+    char type;                      // typeflag of the header, '0' or '\0' for regular files
+    long size;                      // bytes of data mytar_read gives, only the stored regions of sparse files
+    long real_size;                 // size of the file, bigger than size when it is sparse
+    long mode;
+    long uid;
+    long gid;
+    long mtime;
+    long offset;                    // archive offset where the member starts, including its extended headers
+};
+
+// starts reading the archive from fd, which may be a regular file or a pipe, plain or gzip
+// or zstd compressed, fd stays open after mytar_close
+// returns NULL and writes the reason to error (which may be NULL if error_size is 0) on failure
+struct mytar *mytar_open(int fd, char *error, size_t error_size);
+
+// moves to the next member, data of the current one that was not read is skipped,
+// returns 1 and fills entry in, 0 at the end of archive, -1 on error
+int mytar_next(struct mytar *archive, struct mytar_entry *entry);
+
+// copies up to size bytes of the current member's data to buffer,
+// returns their count, 0 once the data is over, -1 on error
+ssize_t mytar_read(struct mytar *archive, void *buffer, size_t size);
+
+// skips the rest of the current member's data, returns 0 or -1 on error
+int mytar_skip(struct mytar *archive);
+
+// reason of the error a call returned, empty if there was none,
+// after an error the archive can only be closed
+const char *mytar_error(struct mytar *archive);
+
+void mytar_close(struct mytar *archive);
+
+#endif